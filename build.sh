@@ -0,0 +1,8 @@
+#!/bin/sh
+mkdir -p release
+rm -f release/CavesOfTitan
+g++ -std=c++11 -Os -Iinclude main.cpp -Llib -Wl,-rpath,'$ORIGIN' -lOpenCL -lglfw -lGL -lIrrKlang -lpthread -o release/CavesOfTitan || exit 1
+rm -rf release/kernels release/shaders release/images release/sfx
+for d in kernels shaders images sfx; do
+    if [ -d $d ]; then cp -r $d release/$d; fi
+done
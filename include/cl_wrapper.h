@@ -2,12 +2,24 @@
 
 #include <GLFW/glfw3.h>
 #include <CL/cl.hpp>
+#if !defined(_WIN32) && !defined(__APPLE__)
+#include <GL/glx.h>
+#endif
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE 0x812F // GL 1.2, missing from the Windows SDK's gl.h
+#endif
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <tuple>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <iomanip>
 
 using std::cerr;
 using std::cout;
@@ -24,7 +36,8 @@ using std::ofstream;
 enum DeviceType 
 { 
 	DEVICE_CPU			= (1 << 1), 
-	DEVICE_GPU			= (1 << 2)
+	DEVICE_GPU			= (1 << 2),
+	DEVICE_ANY			= (1 << 1) | (1 << 2)
 };
 
 enum MemoryType
@@ -186,6 +199,29 @@ public:
 
 #pragma pack(pop)
 
+// FNV-1a, for the program and device cache keys and the checksum
+inline uint64_t hashBytes(const void * data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char * bytes = (const unsigned char *)data;
+    for (size_t i=0; i<size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// A frame CLContext times on each device to choose between them. setup builds it in the device's own
+// context and returns false if it can't run there; reset restores the starting state outside the timed
+// span, so every frame does the same work. name is part of the devices.cfg key.
+class CLBenchmark {
+public:
+    virtual ~CLBenchmark() {}
+    virtual string name() = 0;
+    virtual bool setup(cl::Context & context, cl::Device & device, cl::CommandQueue & queue) = 0;
+    virtual CLInt reset(cl::CommandQueue & queue) = 0;
+    virtual CLInt frame(cl::CommandQueue & queue) = 0;
+};
+
+#define BENCH_FRAMES 8
+
 class CLContext {
 public:
     cl::Context				context;
@@ -195,46 +231,198 @@ public:
     size_t                  preferredDevice;
     size_t                  preferredPlatform;
     size_t                  preferredDeviceWorkload;
-
-    CLContext() {
+    DeviceType              deviceType;
+    bool                    glShared; // kernels can write GL textures (CLImageGL) directly
+
+    // Picks the fastest device of deviceType, or of any type if there is none (e.g. PoCL on a machine
+    // without a GPU): with more than one candidate each runs bench and the choice is kept in cachePath
+    // under a key of the candidate list and the benchmark, so it is only measured again when either
+    // changes. Without a bench the first candidate is taken. TITAN_DEVICE=<part of a device name> in the
+    // environment overrides both.
+    // shareGL asks for GL interop with the current GL context; it falls back to a plain context when the
+    // device or platform can't share, and headless runs don't ask.
+    CLContext(bool shareGL = true, DeviceType type = DEVICE_ANY, CLBenchmark * bench = NULL, string cachePath = "devices.cfg") {
 
         cl::Platform::get(&platforms);
 
-        preferredDevice = 0;
-        preferredPlatform = 0;
-        preferredDeviceWorkload = 0;
+        vector<std::pair<size_t, cl::Device> > candidates;
+        listDevices(type, candidates);
+        if (candidates.empty() && type != DEVICE_ANY) {
+            listDevices(DEVICE_ANY, candidates);
+        }
+        if (candidates.empty()) {
+            cerr << "CLContext: no OpenCL devices" << endl;
+            exit(1);
+        }
 
-        for (size_t j=0; j<platforms.size(); j++) {
-            platforms[j].getDevices(static_cast<cl_device_type>(DEVICE_GPU), &devices);
-            for (size_t i=0; i<devices.size(); i++) {
-                size_t workload = devices[i].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
-                if (workload > preferredDeviceWorkload) {
-                    preferredDevice = i;
-                    preferredPlatform = j;
-                    preferredDeviceWorkload = workload;
-                }
+        size_t chosen = chooseDevice(candidates, bench, cachePath);
+        cl::Device & device = candidates[chosen].second;
+        preferredPlatform = candidates[chosen].first;
+        preferredDeviceWorkload = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+        deviceType = (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_GPU) ? DEVICE_GPU : DEVICE_CPU;
+
+        devices.clear();
+        platforms[preferredPlatform].getDevices(static_cast<cl_device_type>(deviceType), &devices);
+        preferredDevice = 0;
+        for (size_t i=0; i<devices.size(); i++) {
+            if (devices[i]() == device()) {
+                preferredDevice = i;
             }
         }
 
-        platforms[preferredPlatform].getDevices(static_cast<cl_device_type>(DEVICE_GPU), &devices);
+        string extensions = devices[preferredDevice].getInfo<CL_DEVICE_EXTENSIONS>();
+        glShared = shareGL && extensions.find("cl_khr_gl_sharing") != string::npos;
+
+        vector<cl_context_properties> properties;
+        if (glShared) {
+#ifdef _WIN32
+            properties.push_back(CL_GL_CONTEXT_KHR);
+            properties.push_back((cl_context_properties)wglGetCurrentContext());
+            properties.push_back(CL_WGL_HDC_KHR);
+            properties.push_back((cl_context_properties)wglGetCurrentDC());
+#elif !defined(__APPLE__)
+            properties.push_back(CL_GL_CONTEXT_KHR);
+            properties.push_back((cl_context_properties)glXGetCurrentContext());
+            properties.push_back(CL_GLX_DISPLAY_KHR);
+            properties.push_back((cl_context_properties)glXGetCurrentDisplay());
+#endif
+        }
+        properties.push_back(CL_CONTEXT_PLATFORM);
+        properties.push_back((cl_context_properties)(platforms[preferredPlatform])());
+        properties.push_back(0);
 
-        cerr << "OpenGL/CL Context\n" << "Name: " << devices[preferredDevice].getInfo<CL_DEVICE_NAME>()
+        CLInt err;
+        context = cl::Context(devices, &properties[glShared ? 0 : properties.size() - 3], NULL, NULL, &err);
+        if (err != CL_SUCCESS && glShared) {
+            ReportError(err, "CLContext (GL sharing): ");
+            glShared = false;
+            context = cl::Context(devices, &properties[properties.size() - 3], NULL, NULL, &err);
+        }
+        ReportError(err, "CLContext: ");
+
+        cerr << (glShared ? "OpenGL/CL Context\n" : "OpenCL Context\n") << "Name: " << devices[preferredDevice].getInfo<CL_DEVICE_NAME>()
+            << "\nType: " << (deviceType == DEVICE_GPU ? "GPU" : "CPU")
             << "\nVendor: " << devices[preferredDevice].getInfo<CL_DEVICE_VENDOR>() 
             << "\nDriver Version: " << devices[preferredDevice].getInfo<CL_DRIVER_VERSION>() 
             << "\nDevice Profile: " << devices[preferredDevice].getInfo<CL_DEVICE_PROFILE>() 
             << "\nDevice Version: " << devices[preferredDevice].getInfo<CL_DEVICE_VERSION>()
             << "\nMax Work Group Size: " << devices[preferredDevice].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()
             << endl;
-        
-        cl_context_properties properties[] = {
-            CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(),
-            CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(),
-            CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[preferredPlatform])(),
-            0
-        };
 
-        context = cl::Context(devices, properties);
+    }
 
+    void listDevices(DeviceType type, vector<std::pair<size_t, cl::Device> > & candidates) {
+        for (size_t j=0; j<platforms.size(); j++) {
+            vector<cl::Device> found;
+            platforms[j].getDevices(static_cast<cl_device_type>(type), &found);
+            for (size_t i=0; i<found.size(); i++) {
+                candidates.push_back(std::make_pair(j, found[i]));
+            }
+        }
+    }
+
+    static string deviceId(cl::Device & device) {
+        return device.getInfo<CL_DEVICE_NAME>() + "|" + device.getInfo<CL_DRIVER_VERSION>();
+    }
+
+    size_t chooseDevice(vector<std::pair<size_t, cl::Device> > & candidates, CLBenchmark * bench, string cachePath) {
+        const char * env = getenv("TITAN_DEVICE");
+        if (env != NULL && env[0] != 0) {
+            for (size_t i=0; i<candidates.size(); i++) {
+                if (candidates[i].second.getInfo<CL_DEVICE_NAME>().find(env) != string::npos) {
+                    cerr << "CLContext: TITAN_DEVICE picks " << deviceId(candidates[i].second) << endl;
+                    return i;
+                }
+            }
+            cerr << "CLContext: TITAN_DEVICE=" << env << " matches no device" << endl;
+        }
+        if (candidates.size() == 1 || bench == NULL) {
+            return 0;
+        }
+
+        string list = bench->name() + ";";
+        for (size_t i=0; i<candidates.size(); i++) {
+            list += deviceId(candidates[i].second) + ";";
+        }
+        stringstream key;
+        key << std::hex << hashBytes(list.c_str(), list.length());
+
+        // one line per device list: key, tab, the id of the device picked
+        vector<string> lines;
+        ifstream in(cachePath.c_str());
+        string line;
+        while (std::getline(in, line)) {
+            size_t tab = line.find('\t');
+            if (tab == string::npos) {
+                continue;
+            }
+            if (line.substr(0, tab) == key.str()) {
+                for (size_t i=0; i<candidates.size(); i++) {
+                    if (deviceId(candidates[i].second) == line.substr(tab + 1)) {
+                        return i;
+                    }
+                }
+                continue;
+            }
+            lines.push_back(line);
+        }
+        in.close();
+
+        size_t best = 0;
+        double bestMs = -1.;
+        for (size_t i=0; i<candidates.size(); i++) {
+            double ms = benchmark(candidates[i].second, bench);
+            cerr << "CLContext: " << deviceId(candidates[i].second) << ": ";
+            if (ms < 0.) {
+                cerr << "benchmark failed" << endl;
+                continue;
+            }
+            cerr << ms << "ms per benchmark frame" << endl;
+            if (bestMs < 0. || ms < bestMs) {
+                best = i;
+                bestMs = ms;
+            }
+        }
+
+        ofstream out(cachePath.c_str(), std::ios::trunc);
+        for (size_t i=0; i<lines.size(); i++) {
+            out << lines[i] << "\n";
+        }
+        out << key.str() << "\t" << deviceId(candidates[best].second) << "\n";
+        return best;
+    }
+
+    // Best wall time in ms of a frame of bench on device, in a context of its own; -1 if it can't be run
+    double benchmark(cl::Device & device, CLBenchmark * bench) {
+        vector<cl::Device> one(1, device);
+        cl_int err;
+        cl::Context ctx(one, NULL, NULL, NULL, &err);
+        if (err != CL_SUCCESS) {
+            return -1.;
+        }
+        cl::CommandQueue queue(ctx, device, 0, &err);
+        if (err != CL_SUCCESS || !bench->setup(ctx, device, queue)) {
+            return -1.;
+        }
+
+        double best = -1.;
+        for (int f=0; f<=BENCH_FRAMES; f++) {
+            if (bench->reset(queue) != CL_SUCCESS || queue.finish() != CL_SUCCESS) {
+                return -1.;
+            }
+            std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+            err = bench->frame(queue);
+            err |= queue.finish();
+            if (err != CL_SUCCESS) {
+                return -1.;
+            }
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+            // the first frame is a warm-up
+            if (f > 0 && (best < 0. || ms < best)) {
+                best = ms;
+            }
+        }
+        return best;
     }
 
     void ReportError(CLInt err, string prefix) {
@@ -384,9 +572,16 @@ public:
     }
 };
 
+// Distinguishes memory objects that reuse a freed one's address, so cached kernel args notice the swap
+inline size_t nextCLSerial() {
+    static size_t serial = 0;
+    return ++serial;
+}
+
 class CLBuffer;
 class CLBufferGL;
 class CLImageGL;
+class CLFrameGraph;
 
 class CLProgram {
 public:
@@ -396,30 +591,55 @@ public:
     cl::Event event;
     cl::CommandQueue queue;
     map<string, cl::Kernel*> functions;
+    map<string, double> kernelTime;
     CLContext * context;
+    bool profile;
+    CLFrameGraph * graph;
+    string buildOptions;
 
-    CLProgram(CLContext * _context, string filename) {
+    CLProgram(CLContext * _context, string filename, bool _profile = false, string options = "") {
         context = _context;
-        init(filename);
+        profile = _profile;
+        init(filename, options);
     }
 
-    CLProgram(CLContext & _context, string filename) {
+    CLProgram(CLContext & _context, string filename, bool _profile = false, string options = "") {
         context = &_context;
-        init(filename);
+        profile = _profile;
+        init(filename, options);
     }
 
-    void init(string filename) {
+    void init(string filename, string options) {
+        graph = NULL;
+        buildOptions = options;
         ifstream file((string("kernels/") + filename + ".cl").c_str());
         stringstream buffer;
         buffer << file.rdbuf();
         string code = buffer.str();
-        
+
+        // Binaries from an earlier run are reused when the devices, drivers, options and source all match
+        std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+        stringstream cachePath;
+        cachePath << "kernels/" << filename;
+        if (!buildOptions.empty()) {
+            cachePath << "-" << std::hex << hashBytes(buildOptions.c_str(), buildOptions.length());
+        }
+        cachePath << ".bin";
+        string key = cacheKey(code);
+        bool cached = loadBinaries(cachePath.str(), key);
+        if (!cached) {
+            source = cl::Program::Sources(1, std::make_pair(code.c_str(), code.length()));
+            program = cl::Program(context->context, source);
+            err = program.build(context->devices, buildOptions.c_str());
+        }
+        double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+        cerr << filename << (buildOptions.empty() ? "" : " [" + buildOptions + "]") << ": program cache " << (cached ? "hit" : "miss") << ", built in " << buildMs << "ms" << endl;
+        if (!cached && err == CL_SUCCESS) {
+            saveBinaries(cachePath.str(), key);
+        }
         err = CL_SUCCESS;
-        source = cl::Program::Sources(1, std::make_pair(code.c_str(), code.length()));
-        context->ReportError(err, filename + ": ");
-        program = cl::Program(context->context, source);
-        program.build(context->devices);
-        queue = cl::CommandQueue(context->context, context->devices[context->preferredDevice], 0, &err);
+
+        queue = cl::CommandQueue(context->context, context->devices[context->preferredDevice], profile ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
         context->ReportError(err, filename + ": ");
 
         cl::STRING_CLASS errStr = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context->devices[context->preferredDevice]);
@@ -429,6 +649,108 @@ public:
         }
     }
 
+    string cacheKey(const string & code) {
+        stringstream ss;
+        ss << "CLProgram cache 1\n";
+        for (size_t i=0; i<context->devices.size(); i++) {
+            ss << context->devices[i].getInfo<CL_DEVICE_NAME>() << "|" << context->devices[i].getInfo<CL_DRIVER_VERSION>()
+               << "|" << context->devices[i].getInfo<CL_DEVICE_VERSION>() << "\n";
+        }
+        ss << "options: " << buildOptions << "\n";
+        ss << "source: " << std::hex << hashBytes(code.c_str(), code.length()) << "\n";
+        return ss.str();
+    }
+
+    // Cache file: the key, then a size and image per device, then a checksum of the images. Anything
+    // missing, stale or corrupt returns false with program untouched, and the caller builds from source.
+    bool loadBinaries(string path, string key) {
+        ifstream in(path.c_str(), std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        string header;
+        std::getline(in, header, '\0');
+        if (!in || header != key) {
+            return false;
+        }
+        vector<vector<char> > images(context->devices.size());
+        cl::Program::Binaries binaries;
+        uint64_t checksum = hashBytes(NULL, 0);
+        for (size_t i=0; i<images.size(); i++) {
+            uint64_t size = 0;
+            in.read((char *)&size, sizeof(size));
+            if (!in || size == 0 || size > (1ULL << 30)) {
+                return false;
+            }
+            images[i].resize((size_t)size);
+            in.read(&images[i][0], (std::streamsize)size);
+            if (!in) {
+                return false;
+            }
+            checksum = hashBytes(&images[i][0], images[i].size(), checksum);
+            binaries.push_back(std::make_pair((const void *)&images[i][0], images[i].size()));
+        }
+        uint64_t stored = 0;
+        in.read((char *)&stored, sizeof(stored));
+        if (!in || stored != checksum) {
+            cerr << path << ": corrupt program cache, rebuilding" << endl;
+            return false;
+        }
+
+        cl_int status = CL_SUCCESS;
+        vector<cl_int> binaryStatus(images.size(), CL_SUCCESS);
+        cl::Program cachedProgram(context->context, context->devices, binaries, &binaryStatus, &status);
+        if (status != CL_SUCCESS) {
+            return false;
+        }
+        for (size_t i=0; i<binaryStatus.size(); i++) {
+            if (binaryStatus[i] != CL_SUCCESS) {
+                return false;
+            }
+        }
+        if (cachedProgram.build(context->devices, buildOptions.c_str()) != CL_SUCCESS) {
+            return false;
+        }
+        program = cachedProgram;
+        return true;
+    }
+
+    // Written to a temporary file first so an interrupted run never leaves a half-written cache behind
+    void saveBinaries(string path, string key) {
+        vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+        vector<vector<char> > images(sizes.size());
+        vector<char *> pointers(sizes.size());
+        for (size_t i=0; i<sizes.size(); i++) {
+            if (sizes[i] == 0) {
+                return;
+            }
+            images[i].resize(sizes[i]);
+            pointers[i] = &images[i][0];
+        }
+        if (pointers.empty() || clGetProgramInfo(program(), CL_PROGRAM_BINARIES, pointers.size() * sizeof(char *), &pointers[0], NULL) != CL_SUCCESS) {
+            return;
+        }
+
+        string tmpPath = path + ".tmp";
+        ofstream out(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+        out.write(key.c_str(), key.length() + 1);
+        uint64_t checksum = hashBytes(NULL, 0);
+        for (size_t i=0; i<images.size(); i++) {
+            uint64_t size = images[i].size();
+            out.write((const char *)&size, sizeof(size));
+            out.write(&images[i][0], (std::streamsize)size);
+            checksum = hashBytes(&images[i][0], images[i].size(), checksum);
+        }
+        out.write((const char *)&checksum, sizeof(checksum));
+        out.close();
+        if (!out) {
+            remove(tmpPath.c_str());
+            return;
+        }
+        remove(path.c_str());
+        rename(tmpPath.c_str(), path.c_str());
+    }
+
     cl::Kernel * getFunction(string function) {
         if (functions.find(function) != functions.end()) {
             return functions[function];
@@ -439,19 +761,45 @@ public:
         return kernel;
     }
 
-    bool callFunction(string function, size_t n) {
+    size_t localSize(string function) {
         cl::Kernel * kernel = getFunction(function);
         size_t mwSize = kernel->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(context->devices[context->preferredDevice]);
         size_t mul = kernel->getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(context->devices[context->preferredDevice]);
-        size_t localSize = ((size_t)floor((float)mwSize / (float)mul)) * mul;
+        return ((size_t)floor((float)mwSize / (float)mul)) * mul;
+    }
+
+    bool callFunction(string function, size_t n) {
+        return callFunction(function, n, localSize(function));
+    }
+
+    // Blocking launch on the in-order queue; per-frame work goes through CLFrameGraph instead
+    bool callFunction(string function, size_t n, size_t localSize) {
+        flushGraph();
+        cl::Kernel * kernel = getFunction(function);
         size_t globalSize = ((n+localSize-1) / localSize) * localSize;
         cl::Event event;
         int err = queue.enqueueNDRangeKernel(*kernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(localSize), NULL, &event);
         context->ReportError(err, "callFunction: ");
         event.wait();
+        if (profile && err == CL_SUCCESS) {
+            cl_ulong start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            cl_ulong end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+            kernelTime[function] += (double)(end - start) * 1e-6;
+        }
         return err == CL_SUCCESS;
     }
 
+    // Prints the average time per frame spent in each kernel since the last report, in milliseconds
+    void reportProfile(int frames) {
+        double total = 0.;
+        for (map<string, double>::iterator ii=kernelTime.begin(); ii!=kernelTime.end(); ii++) {
+            cerr << ii->first << ": " << (ii->second / (double)frames) << "ms" << endl;
+            total += ii->second;
+        }
+        cerr << "total: " << (total / (double)frames) << "ms/frame" << endl;
+        kernelTime.clear();
+    }
+
     #define _SET_ARG(_TYPE) void setArg(string function, int arg, _TYPE v) { \
         cl_int err = getFunction(function)->setArg(arg, sizeof(_TYPE), &v); \
         if (err != CL_SUCCESS) { \
@@ -490,6 +838,8 @@ public:
     void setArg(string function, int arg, CLImageGL * buffer);
     void acquireImageGL(CLImageGL * buffer);
     void releaseImageGL(CLImageGL * buffer);
+    // Waits for the frame graph when it runs on its own queue, before work is put on this one
+    void flushGraph();
 
     ~CLProgram() {
         for (map<string, cl::Kernel*>::iterator ii=functions.begin(); ii!=functions.end(); ii++) {
@@ -504,15 +854,18 @@ public:
     cl::BufferGL * buffer;
     CLProgram * program;
     GLuint glBuffer;
+    size_t serial;
 
     CLBufferGL() {
         buffer = NULL;
+        serial = 0;
     }
 
     CLBufferGL(CLProgram * _program, GLuint bufferGL, MemoryType memType = MEMORY_READ_WRITE) {
         glBuffer = bufferGL;
         buffer = new cl::BufferGL(_program->context->context, static_cast<cl_mem_flags>(memType), glBuffer);
         program = _program;
+        serial = nextCLSerial();
     }
     ~CLBufferGL() {
         if (buffer != NULL) {
@@ -527,45 +880,74 @@ public:
     cl::Image2DGL * buffer;
     CLProgram * program;
     GLuint glTex, width, height;
-    GLubyte * colorBuffer;
+    size_t serial;
 
     CLImageGL() {
         buffer = NULL;
-        colorBuffer = NULL;
+        glTex = 0;
+        serial = 0;
     }
 
+    // Without GL sharing (CLContext::glShared) only the texture is made, and frames are uploaded to it
+    // from the host (GLPixelUpload)
     CLImageGL(CLProgram * _program, GLuint _width, GLuint _height, MemoryType memType = MEMORY_READ_WRITE) {
         width = _width;
         height = _height;
-        colorBuffer = new GLubyte[width*height*4];
         glDisable(GL_LIGHTING);
         glEnable(GL_TEXTURE_2D);
         glGenTextures(1, &glTex);
         glBindTexture(GL_TEXTURE_2D, glTex);
-        for (size_t i=0; i<width*height; i++) {
-            colorBuffer[i*4] = 0;
-            colorBuffer[i*4+1] = 0;
-            colorBuffer[i*4+2] = 0;
-            colorBuffer[i*4+3] = 255;
-        }
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, colorBuffer);
-        CLInt err;
-        buffer = new cl::Image2DGL(_program->context->context, static_cast<cl_mem_flags>(memType), GL_TEXTURE_2D, 0, glTex, &err);
-        _program->context->ReportError(err, "CLImageGL(): ");
+        // storage only, the kernels write every texel that gets drawn
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        buffer = NULL;
+        if (_program->context->glShared) {
+            CLInt err;
+            buffer = new cl::Image2DGL(_program->context->context, static_cast<cl_mem_flags>(memType), GL_TEXTURE_2D, 0, glTex, &err);
+            _program->context->ReportError(err, "CLImageGL(): ");
+        }
         program = _program;
+        serial = nextCLSerial();
     }
     ~CLImageGL() {
         if (buffer != NULL) {
             delete buffer;
             buffer = NULL;
         }
-        if (colorBuffer != NULL) {
-            delete colorBuffer;
-            colorBuffer = NULL;
+        glDeleteTextures(1, &glTex);
+    }
+};
+
+// A device-only 2D image, for data kernels read through the texture units with a sampler
+class CLImage {
+public:
+    cl::Image2D * buffer;
+    CLProgram * program;
+    size_t width, height;
+    size_t serial;
+
+    CLImage() {
+        buffer = NULL;
+        serial = 0;
+    }
+
+    CLImage(CLProgram * _program, size_t _width, size_t _height, cl_channel_order order = CL_RGBA, cl_channel_type type = CL_UNORM_INT8,
+            MemoryType memType = MEMORY_READ_WRITE) {
+        width = _width;
+        height = _height;
+        CLInt err;
+        buffer = new cl::Image2D(_program->context->context, static_cast<cl_mem_flags>(memType), cl::ImageFormat(order, type), width, height, 0, NULL, &err);
+        _program->context->ReportError(err, "CLImage(): ");
+        program = _program;
+        serial = nextCLSerial();
+    }
+    ~CLImage() {
+        if (buffer != NULL) {
+            delete buffer;
+            buffer = NULL;
         }
     }
 };
@@ -578,11 +960,13 @@ public:
     size_t elSize;
     size_t length;
     CLProgram * program;
+    size_t serial;
 
     CLBuffer() {
         data = NULL;
         dataSize = 0;
         buffer = NULL;
+        serial = 0;
     }
 
     CLBuffer(CLProgram * _program, size_t sizeBytes, MemoryType memType = MEMORY_READ_WRITE) {
@@ -592,6 +976,7 @@ public:
         memset(data, 0, dataSize);
         buffer = new cl::Buffer(_program->context->context, static_cast<cl_mem_flags>(memType), dataSize);
         program = _program;
+        serial = nextCLSerial();
     }
 
     CLBuffer(CLProgram * _program, size_t numberElements, size_t elementSize, MemoryType memType = MEMORY_READ_WRITE) {
@@ -601,6 +986,7 @@ public:
         memset(data, 0, dataSize);
         buffer = new cl::Buffer(_program->context->context, static_cast<cl_mem_flags>(memType), dataSize);
         program = _program;
+        serial = nextCLSerial();
     }
 
     ~CLBuffer() {
@@ -630,6 +1016,7 @@ public:
     CLInt4 * dataInt4 () { return (CLInt4*)data; }
 
     void readSync() {
+        program->flushGraph();
         cl::Event event;
         cl_int err = program->queue.enqueueReadBuffer(*buffer, true, 0, dataSize, data, NULL, &event);
         program->context->ReportError(err, "readSync: ");
@@ -637,13 +1024,22 @@ public:
     }
 
     void readSync(size_t offset, size_t size, void * readData) {
+        program->flushGraph();
         cl::Event event;
         cl_int err = program->queue.enqueueReadBuffer(*buffer, true, offset, size, readData, NULL, &event);
         program->context->ReportError(err, "readSync: ");
         event.wait();
     }
 
+    // Non-blocking read; readData is valid once event completes
+    void readAsync(size_t offset, size_t size, void * readData, cl::Event * event) {
+        program->flushGraph();
+        cl_int err = program->queue.enqueueReadBuffer(*buffer, false, offset, size, readData, NULL, event);
+        program->context->ReportError(err, "readAsync: ");
+    }
+
     void writeSync() {
+        program->flushGraph();
         cl::Event event;
         cl_int err = program->queue.enqueueWriteBuffer(*buffer, true, 0, dataSize, data, NULL, &event);
         program->context->ReportError(err, "writeSync: ");
@@ -651,11 +1047,24 @@ public:
     }
 
     void writeSync(size_t offset, size_t size, const void * writeData) {
+        program->flushGraph();
         cl::Event event;
         cl_int err = program->queue.enqueueWriteBuffer(*buffer, true, offset, size, writeData, NULL, &event);
         program->context->ReportError(err, "writeSync: ");
         event.wait();
     }
+
+    void copySync(CLBuffer * src, size_t size) {
+        copySync(src, 0, 0, size);
+    }
+
+    void copySync(CLBuffer * src, size_t srcOffset, size_t offset, size_t size) {
+        program->flushGraph();
+        cl::Event event;
+        cl_int err = program->queue.enqueueCopyBuffer(*(src->buffer), *buffer, srcOffset, offset, size, NULL, &event);
+        program->context->ReportError(err, "copySync: ");
+        event.wait();
+    }
 };
 
 void CLProgram::setArg(string function, int arg, CLBuffer * buffer) {
@@ -671,6 +1080,7 @@ void CLProgram::setArg(string function, int arg, CLImageGL * buffer) {
 }
 
 void CLProgram::acquireImageGL(CLImageGL * buffer) {
+    flushGraph();
     vector<cl::Memory> mem;
     mem.push_back(*(buffer->buffer));
 
@@ -679,6 +1089,7 @@ void CLProgram::acquireImageGL(CLImageGL * buffer) {
 }
 
 void CLProgram::releaseImageGL(CLImageGL * buffer) {
+    flushGraph();
     vector<cl::Memory> mem;
     mem.push_back(*(buffer->buffer));
 
@@ -686,4 +1097,651 @@ void CLProgram::releaseImageGL(CLImageGL * buffer) {
     
     CLInt er1 = queue.enqueueReleaseGLObjects(&mem, NULL, &event);
     event.wait();
-}
\ No newline at end of file
+}
+
+typedef map<string, string> CLDefines;
+
+// "-D NAME=VALUE ..." in name order, so equal define sets give equal build options
+inline string defineOptions(const CLDefines & defines) {
+    stringstream ss;
+    for (CLDefines::const_iterator ii=defines.begin(); ii!=defines.end(); ii++) {
+        ss << (ii == defines.begin() ? "" : " ") << "-D " << ii->first << "=" << ii->second;
+    }
+    return ss.str();
+}
+
+template <class T> string defineValue(T v) {
+    stringstream ss;
+    ss << v;
+    return ss.str();
+}
+
+inline string defineValue(float v) {
+    stringstream ss;
+    ss << std::setprecision(9) << std::showpoint << v << "f";
+    return ss.str();
+}
+
+// One program per define set, built (or loaded from the binary cache) the first time it is asked for
+// and kept until the cache is deleted. They share the context, so buffers and images created through
+// any of them can be passed to kernels from the others.
+class CLProgramCache {
+public:
+    CLContext * context;
+    string filename;
+    bool profile;
+    map<string, CLProgram *> programs;
+
+    CLProgramCache(CLContext * _context, string _filename, bool _profile = false) {
+        context = _context;
+        filename = _filename;
+        profile = _profile;
+    }
+
+    CLProgram * get(const CLDefines & defines) {
+        string options = defineOptions(defines);
+        map<string, CLProgram *>::iterator ii = programs.find(options);
+        if (ii != programs.end()) {
+            return ii->second;
+        }
+        CLProgram * program = new CLProgram(context, filename, profile, options);
+        programs[options] = program;
+        return program;
+    }
+
+    ~CLProgramCache() {
+        for (map<string, CLProgram *>::iterator ii=programs.begin(); ii!=programs.end(); ii++) {
+            delete ii->second;
+        }
+        programs.clear();
+    }
+};
+
+// Argument setters for CLKernelHandle, picked by overload from the handle's argument types
+template <class T> cl_int setKernelArg(cl::Kernel * kernel, int arg, const T & v) {
+    return kernel->setArg(arg, sizeof(T), (void *)&v);
+}
+
+template <class T> size_t kernelArgSerial(const T & v) {
+    return 0;
+}
+
+inline size_t kernelArgSerial(CLBuffer * buffer) {
+    return buffer->serial;
+}
+
+inline size_t kernelArgSerial(CLBufferGL * buffer) {
+    return buffer->serial;
+}
+
+inline size_t kernelArgSerial(CLImageGL * buffer) {
+    return buffer->serial;
+}
+
+inline size_t kernelArgSerial(CLImage * buffer) {
+    return buffer->serial;
+}
+
+inline cl_int setKernelArg(cl::Kernel * kernel, int arg, CLBuffer * buffer) {
+    return kernel->setArg(arg, sizeof(cl::Buffer), buffer->buffer);
+}
+
+inline cl_int setKernelArg(cl::Kernel * kernel, int arg, CLBufferGL * buffer) {
+    return kernel->setArg(arg, sizeof(cl::BufferGL), buffer->buffer);
+}
+
+inline cl_int setKernelArg(cl::Kernel * kernel, int arg, CLImageGL * buffer) {
+    return kernel->setArg(arg, sizeof(cl::Image2DGL), buffer->buffer);
+}
+
+inline cl_int setKernelArg(cl::Kernel * kernel, int arg, CLImage * buffer) {
+    return kernel->setArg(arg, sizeof(cl::Image2D), buffer->buffer);
+}
+
+// The launch side of a kernel handle: the resolved kernel and the work group shape its launches use.
+// localSize is for 1D launches and localShape for 2D ones; both start at the device's default and
+// can be replaced from a CLTuning file.
+class CLKernelBase {
+public:
+    CLProgram * program;
+    string name;
+    cl::Kernel * kernel;
+    size_t localSize;
+    size_t localShape[2];
+    size_t maxLocalSize;
+    size_t localMultiple;
+
+    CLKernelBase(CLProgram * _program, string _name) {
+        program = _program;
+        name = _name;
+        kernel = program->getFunction(name);
+        cl::Device & device = program->context->devices[program->context->preferredDevice];
+        maxLocalSize = kernel->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+        localMultiple = std::max(kernel->getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device), (size_t)1);
+        localSize = program->localSize(name);
+        localShape[0] = localSize;
+        localShape[1] = 1;
+    }
+
+    virtual ~CLKernelBase() {
+    }
+
+    // Work group shapes worth timing: powers of two times the preferred multiple, up to the kernel's
+    // limit, and for 2D launches every split of those into width x height with a width of at least 8
+    vector<std::pair<size_t, size_t> > candidates(bool twoD) {
+        vector<std::pair<size_t, size_t> > shapes;
+        for (size_t total=localMultiple; total<=maxLocalSize; total*=2) {
+            if (!twoD) {
+                shapes.push_back(std::make_pair(total, (size_t)1));
+                continue;
+            }
+            for (size_t height=1; height<=total/8; height*=2) {
+                shapes.push_back(std::make_pair(total / height, height));
+            }
+        }
+        return shapes;
+    }
+};
+
+// A kernel resolved once, with its work group size cached and its arguments typed. bind() keeps the
+// last value of every argument and only calls clSetKernelArg for the ones that changed, so buffers
+// and constants bound every frame cost a compare; buffers also compare their serial, so one recreated
+// at a freed one's address is still rebound. Don't mix with CLProgram::setArg on the same kernel.
+template <class... Args> class CLKernelHandle : public CLKernelBase {
+public:
+    typedef std::tuple<Args...> Values;
+    static const int NumArgs = sizeof...(Args);
+
+    Values values;
+    size_t serials[NumArgs + 1];
+    bool bound[NumArgs + 1];
+
+    CLKernelHandle(CLProgram * _program, string _name) : CLKernelBase(_program, _name) {
+        for (int i=0; i<NumArgs; i++) {
+            bound[i] = false;
+        }
+    }
+
+    void bind(const Args &... args) {
+        bindFrom<0>(args...);
+    }
+
+    template <int I> void set(const typename std::tuple_element<I, Values>::type & v) {
+        typedef typename std::tuple_element<I, Values>::type T;
+        T & last = std::get<I>(values);
+        size_t serial = kernelArgSerial(v);
+        if (bound[I] && serials[I] == serial && memcmp(&last, &v, sizeof(T)) == 0) {
+            return;
+        }
+        last = v;
+        serials[I] = serial;
+        bound[I] = true;
+        cl_int err = setKernelArg(kernel, I, v);
+        if (err != CL_SUCCESS) {
+            stringstream ss;
+            ss << name << "(" << I << "): ";
+            program->context->ReportError(err, ss.str());
+        }
+    }
+
+    // Forces every argument to be set again on the next bind()
+    void invalidate() {
+        for (int i=0; i<NumArgs; i++) {
+            bound[i] = false;
+        }
+    }
+
+private:
+    template <int I> void bindFrom() {
+    }
+
+    template <int I, class T, class... Rest> void bindFrom(const T & v, const Rest &... rest) {
+        set<I>(v);
+        bindFrom<I + 1>(rest...);
+    }
+};
+
+// Best work group shapes found by an autotune run, one line per device and kernel:
+// "<device>|<driver>\t<kernel>\t<x> <y>". Kernels without an entry keep the device default.
+class CLTuning {
+public:
+    string path;
+    string device;
+    map<string, std::pair<size_t, size_t> > shapes;
+    map<string, string> otherDevices;
+
+    CLTuning(CLContext * context, string _path) {
+        path = _path;
+        cl::Device & dev = context->devices[context->preferredDevice];
+        device = dev.getInfo<CL_DEVICE_NAME>() + "|" + dev.getInfo<CL_DRIVER_VERSION>();
+        ifstream in(path.c_str());
+        string line;
+        while (std::getline(in, line)) {
+            size_t tab1 = line.find('\t'), tab2 = line.find('\t', tab1 + 1);
+            if (tab1 == string::npos || tab2 == string::npos) {
+                continue;
+            }
+            string kernel = line.substr(tab1 + 1, tab2 - tab1 - 1);
+            if (line.substr(0, tab1) != device) {
+                otherDevices[line.substr(0, tab2)] = line;
+                continue;
+            }
+            stringstream ss(line.substr(tab2 + 1));
+            size_t x = 0, y = 0;
+            if (ss >> x >> y && x > 0 && y > 0) {
+                shapes[kernel] = std::make_pair(x, y);
+            }
+        }
+    }
+
+    // Applies a stored shape if it is still valid for this build of the kernel
+    bool apply(CLKernelBase * handle) {
+        map<string, std::pair<size_t, size_t> >::iterator ii = shapes.find(handle->name);
+        if (ii == shapes.end() || ii->second.first * ii->second.second > handle->maxLocalSize) {
+            return false;
+        }
+        handle->localSize = ii->second.first * ii->second.second;
+        handle->localShape[0] = ii->second.first;
+        handle->localShape[1] = ii->second.second;
+        return true;
+    }
+
+    void store(string kernel, size_t x, size_t y) {
+        shapes[kernel] = std::make_pair(x, y);
+    }
+
+    // Rewrites the file, keeping the entries of other devices
+    void save() {
+        ofstream out(path.c_str(), std::ios::trunc);
+        for (map<string, string>::iterator ii=otherDevices.begin(); ii!=otherDevices.end(); ii++) {
+            out << ii->second << "\n";
+        }
+        for (map<string, std::pair<size_t, size_t> >::iterator ii=shapes.begin(); ii!=shapes.end(); ii++) {
+            out << device << "\t" << ii->first << "\t" << ii->second.first << " " << ii->second.second << "\n";
+        }
+    }
+};
+
+typedef vector<const void *> CLResources;
+
+// Records a frame's kernels and transfers without blocking. Each pass names the buffers it reads and
+// writes and waits only on the passes it conflicts with (read after write, write after read or write).
+// With an out-of-order queue independent passes may overlap; otherwise the passes go to the program's
+// in-order queue, which already keeps them in order. wait() is the frame's sync point.
+class CLFrameGraph {
+public:
+    CLProgram * program;
+    cl::CommandQueue queue;
+    bool outOfOrder;
+    map<const void *, cl::Event> writer;
+    map<const void *, vector<cl::Event> > readers;
+    vector<cl::Event> pending;
+    vector<string> pendingNames;
+
+    CLFrameGraph(CLProgram * _program, bool allowOutOfOrder = true) {
+        program = _program;
+        cl::Device & device = program->context->devices[program->context->preferredDevice];
+        cl_command_queue_properties props = device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>();
+        outOfOrder = allowOutOfOrder && (props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+        if (outOfOrder) {
+            cl_int err;
+            queue = cl::CommandQueue(program->context->context, device,
+                                     CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | (program->profile ? CL_QUEUE_PROFILING_ENABLE : 0), &err);
+            program->context->ReportError(err, "CLFrameGraph: ");
+        }
+        else {
+            queue = program->queue;
+        }
+        program->graph = this;
+    }
+
+    ~CLFrameGraph() {
+        wait();
+        if (program->graph == this) {
+            program->graph = NULL;
+        }
+    }
+
+    bool kernel(string function, size_t n, const CLResources & reads, const CLResources & writes) {
+        return kernel(function, n, program->localSize(function), reads, writes);
+    }
+
+    bool kernel(string function, size_t n, size_t localSize, const CLResources & reads, const CLResources & writes) {
+        return launch(program->getFunction(function), function, cl::NDRange(roundUp(n, localSize)), cl::NDRange(localSize), reads, writes);
+    }
+
+    bool kernel(CLKernelBase * handle, size_t n, const CLResources & reads, const CLResources & writes) {
+        return kernel(handle, n, handle->localSize, reads, writes);
+    }
+
+    bool kernel(CLKernelBase * handle, size_t n, size_t localSize, const CLResources & reads, const CLResources & writes) {
+        return launch(handle->kernel, handle->name, cl::NDRange(roundUp(n, localSize)), cl::NDRange(localSize), reads, writes);
+    }
+
+    // nx x ny work items in groups of handle->localShape
+    bool kernel2D(CLKernelBase * handle, size_t nx, size_t ny, const CLResources & reads, const CLResources & writes) {
+        return launch(handle->kernel, handle->name, cl::NDRange(roundUp(nx, handle->localShape[0]), roundUp(ny, handle->localShape[1])),
+                      cl::NDRange(handle->localShape[0], handle->localShape[1]), reads, writes);
+    }
+
+    static size_t roundUp(size_t n, size_t multiple) {
+        return ((n + multiple - 1) / multiple) * multiple;
+    }
+
+    bool launch(cl::Kernel * kernel, const string & function, const cl::NDRange & globalSize, const cl::NDRange & localSize,
+                const CLResources & reads, const CLResources & writes) {
+        vector<cl::Event> deps = dependencies(reads, writes);
+        cl::Event event;
+        cl_int err = queue.enqueueNDRangeKernel(*kernel, cl::NullRange, globalSize, localSize,
+                                                deps.empty() ? NULL : &deps, &event);
+        program->context->ReportError(err, function + ": ");
+        if (err != CL_SUCCESS) {
+            return false;
+        }
+        record(function, event, reads, writes);
+        return true;
+    }
+
+    // writeData must stay untouched until done completes (or the next wait())
+    void write(CLBuffer * dst, size_t offset, size_t size, const void * writeData, cl::Event * done = NULL) {
+        vector<cl::Event> deps = dependencies(CLResources(), CLResources(1, dst));
+        cl::Event event;
+        cl_int err = queue.enqueueWriteBuffer(*(dst->buffer), false, offset, size, writeData, deps.empty() ? NULL : &deps, &event);
+        program->context->ReportError(err, "write: ");
+        record("", event, CLResources(), CLResources(1, dst));
+        if (done != NULL) {
+            *done = event;
+        }
+    }
+
+    // readData is valid once done completes (or after the next wait())
+    void read(CLBuffer * src, size_t offset, size_t size, void * readData, cl::Event * done = NULL) {
+        vector<cl::Event> deps = dependencies(CLResources(1, src), CLResources());
+        cl::Event event;
+        cl_int err = queue.enqueueReadBuffer(*(src->buffer), false, offset, size, readData, deps.empty() ? NULL : &deps, &event);
+        program->context->ReportError(err, "read: ");
+        record("", event, CLResources(1, src), CLResources());
+        if (done != NULL) {
+            *done = event;
+        }
+    }
+
+    // Maps the top-left width x height of src; the pointer is valid once done completes, and the image
+    // stays mapped until unmap()
+    void * mapImage(CLImage * src, size_t width, size_t height, size_t * rowPitch, cl::Event * done) {
+        vector<cl::Event> deps = dependencies(CLResources(1, src), CLResources());
+        cl::size_t<3> origin, region;
+        origin[0] = origin[1] = origin[2] = 0;
+        region[0] = width;
+        region[1] = height;
+        region[2] = 1;
+        cl::Event event;
+        cl_int err;
+        void * ptr = queue.enqueueMapImage(*(src->buffer), false, CL_MAP_READ, origin, region, rowPitch, NULL,
+                                           deps.empty() ? NULL : &deps, &event, &err);
+        program->context->ReportError(err, "mapImage: ");
+        record("", event, CLResources(1, src), CLResources());
+        *done = event;
+        return ptr;
+    }
+
+    // Counts as a write, so kernels that render into the image next wait for it
+    void unmap(CLImage * image, void * ptr) {
+        vector<cl::Event> deps = dependencies(CLResources(), CLResources(1, image));
+        cl::Event event;
+        cl_int err = queue.enqueueUnmapMemObject(*(image->buffer), ptr, deps.empty() ? NULL : &deps, &event);
+        program->context->ReportError(err, "unmap: ");
+        record("", event, CLResources(), CLResources(1, image));
+    }
+
+    void acquireGL(CLImageGL * image) {
+        vector<cl::Memory> mem(1, *(image->buffer));
+        vector<cl::Event> deps = dependencies(CLResources(), CLResources(1, image));
+        cl::Event event;
+        cl_int err = queue.enqueueAcquireGLObjects(&mem, deps.empty() ? NULL : &deps, &event);
+        program->context->ReportError(err, "acquireGL: ");
+        record("", event, CLResources(), CLResources(1, image));
+    }
+
+    void releaseGL(CLImageGL * image, cl::Event * done = NULL) {
+        vector<cl::Memory> mem(1, *(image->buffer));
+        vector<cl::Event> deps = dependencies(CLResources(), CLResources(1, image));
+        cl::Event event;
+        cl_int err = queue.enqueueReleaseGLObjects(&mem, deps.empty() ? NULL : &deps, &event);
+        program->context->ReportError(err, "releaseGL: ");
+        record("", event, CLResources(), CLResources(1, image));
+        if (done != NULL) {
+            *done = event;
+        }
+    }
+
+    void wait() {
+        if (pending.empty()) {
+            return;
+        }
+        queue.finish();
+        retire();
+    }
+
+    // Forgets the passes that have finished, so a frame can end without waiting for all of its work
+    void retire() {
+        size_t k = 0;
+        for (size_t i=0; i<pending.size(); i++) {
+            if (!complete(pending[i])) {
+                pending[k] = pending[i];
+                pendingNames[k] = pendingNames[i];
+                k++;
+            }
+            else if (program->profile && pendingNames[i].length() > 0) {
+                cl_ulong start = pending[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+                cl_ulong end = pending[i].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+                program->kernelTime[pendingNames[i]] += (double)(end - start) * 1e-6;
+            }
+        }
+        pending.resize(k);
+        pendingNames.resize(k);
+
+        for (map<const void *, cl::Event>::iterator ii=writer.begin(); ii!=writer.end(); ) {
+            if (complete(ii->second)) {
+                writer.erase(ii++);
+            }
+            else {
+                ii++;
+            }
+        }
+        for (map<const void *, vector<cl::Event> >::iterator ii=readers.begin(); ii!=readers.end(); ii++) {
+            vector<cl::Event> & r = ii->second;
+            size_t n = 0;
+            for (size_t i=0; i<r.size(); i++) {
+                if (!complete(r[i])) {
+                    r[n++] = r[i];
+                }
+            }
+            r.resize(n);
+        }
+    }
+
+    static bool complete(cl::Event & event) {
+        return event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+    }
+
+    vector<cl::Event> dependencies(const CLResources & reads, const CLResources & writes) {
+        vector<cl::Event> deps;
+        if (!outOfOrder) {
+            return deps;
+        }
+        for (size_t i=0; i<reads.size(); i++) {
+            if (writer.find(reads[i]) != writer.end()) {
+                deps.push_back(writer[reads[i]]);
+            }
+        }
+        for (size_t i=0; i<writes.size(); i++) {
+            if (writer.find(writes[i]) != writer.end()) {
+                deps.push_back(writer[writes[i]]);
+            }
+            vector<cl::Event> & r = readers[writes[i]];
+            deps.insert(deps.end(), r.begin(), r.end());
+        }
+        return deps;
+    }
+
+    void record(string name, cl::Event & event, const CLResources & reads, const CLResources & writes) {
+        if (outOfOrder) {
+            for (size_t i=0; i<reads.size(); i++) {
+                readers[reads[i]].push_back(event);
+            }
+            for (size_t i=0; i<writes.size(); i++) {
+                writer[writes[i]] = event;
+                readers[writes[i]].clear();
+            }
+        }
+        pending.push_back(event);
+        pendingNames.push_back(name);
+    }
+};
+
+// Non-blocking reads of one small struct into a ring of N host copies. request() queues a read into
+// the next slot and latest() hands back the newest read that has landed, so the host runs a frame or
+// two behind the device instead of waiting for it. request() only blocks when a slot's read from N
+// requests ago is still in flight.
+template <class T, int N> class CLReadbackRing {
+public:
+    T data[N];
+    cl::Event event[N];
+    bool pending[N];
+    long long sequence[N];
+    long long requested;
+    long long seen;
+    int next;
+
+    CLReadbackRing() {
+        for (int i=0; i<N; i++) {
+            pending[i] = false;
+            sequence[i] = 0;
+        }
+        requested = seen = 0;
+        next = 0;
+    }
+
+    void request(CLFrameGraph * graph, CLBuffer * src, size_t offset) {
+        if (pending[next]) {
+            event[next].wait();
+            pending[next] = false;
+        }
+        graph->read(src, offset, sizeof(T), (void *)&data[next], &event[next]);
+        pending[next] = true;
+        sequence[next] = ++requested;
+        next = (next + 1) % N;
+    }
+
+    bool latest(T & out) {
+        int best = -1;
+        for (int i=0; i<N; i++) {
+            if (pending[i] && CLFrameGraph::complete(event[i])) {
+                pending[i] = false;
+                if (sequence[i] > seen && (best < 0 || sequence[i] > sequence[best])) {
+                    best = i;
+                }
+            }
+        }
+        if (best < 0) {
+            return false;
+        }
+        seen = sequence[best];
+        out = data[best];
+        return true;
+    }
+
+    // Drops every read in flight, for when the source was overwritten from the host
+    void clear() {
+        for (int i=0; i<N; i++) {
+            if (pending[i]) {
+                event[i].wait();
+                pending[i] = false;
+            }
+        }
+        seen = requested;
+    }
+};
+
+// Reads rendered RGBA8 frames back through two images: a frame renders into one while the map of the
+// previous frame's image completes, so the host only waits on work queued a frame earlier. Frames may be
+// smaller than the images and are rendered into their top-left corner.
+class CLFrameReadback {
+public:
+    CLImage * image[2];
+    void * mapped[2];
+    size_t rowPitch[2];
+    size_t width[2], height[2];
+    cl::Event event[2];
+    bool pending[2];
+    int next;
+
+    CLFrameReadback(CLProgram * program, size_t width, size_t height) {
+        for (int i=0; i<2; i++) {
+            image[i] = new CLImage(program, width, height, CL_RGBA, CL_UNORM_INT8, MEMORY_WRITE);
+            mapped[i] = NULL;
+            pending[i] = false;
+        }
+        next = 0;
+    }
+    ~CLFrameReadback() {
+        for (int i=0; i<2; i++) {
+            delete image[i];
+        }
+    }
+
+    // The image to render this frame into, free once collect() has run
+    CLImage * target() {
+        return image[next];
+    }
+
+    // Finishes the read of the image about to be reused (width[next] x height[next]), copying its rows to
+    // out outPitch bytes apart (if not NULL); false when nothing was in flight
+    bool collect(CLFrameGraph * graph, unsigned char * out, size_t outPitch) {
+        if (!pending[next]) {
+            return false;
+        }
+        event[next].wait();
+        if (out != NULL) {
+            for (size_t y=0; y<height[next]; y++) {
+                memcpy(out + y * outPitch, (unsigned char *)mapped[next] + y * rowPitch[next], width[next] * 4);
+            }
+        }
+        graph->unmap(image[next], mapped[next]);
+        pending[next] = false;
+        return true;
+    }
+
+    // The same, tightly packed into out
+    bool collect(CLFrameGraph * graph, vector<unsigned char> & out) {
+        if (!pending[next]) {
+            return false;
+        }
+        out.resize(width[next] * height[next] * 4);
+        return collect(graph, &out[0], width[next] * 4);
+    }
+
+    // Maps the _width x _height frame rendered into this frame's image and moves on to the other one
+    void request(CLFrameGraph * graph, size_t _width, size_t _height) {
+        width[next] = _width;
+        height[next] = _height;
+        mapped[next] = graph->mapImage(image[next], _width, _height, &rowPitch[next], &event[next]);
+        pending[next] = true;
+        next ^= 1;
+    }
+
+    // Finishes both reads without keeping the pixels, oldest first
+    void drain(CLFrameGraph * graph) {
+        for (int i=0; i<2; i++) {
+            collect(graph, NULL, 0);
+            next ^= 1;
+        }
+    }
+};
+
+void CLProgram::flushGraph() {
+    if (graph != NULL && graph->outOfOrder) {
+        graph->wait();
+    }
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+// Writes RGBA8 frames on a thread of its own, as numbered PPM or PNG files or as one raw RGBA stream on
+// stdout (target "-") for an encoder to read. target is a printf pattern for the frame number, e.g.
+// "capture/frame%05d.png"; one without a % gets "-%05d" before its extension.
+class FrameWriter {
+public:
+    enum Format {
+        FORMAT_PPM,
+        FORMAT_PNG,
+        FORMAT_RAW
+    };
+
+    std::string pattern;
+    Format format;
+    int width, height;
+    size_t depth;
+    long long written;
+    bool failed;
+
+    std::deque<std::vector<unsigned char> > queue;
+    std::vector<std::vector<unsigned char> > spare;
+    std::mutex lock;
+    std::condition_variable changed;
+    bool closing;
+    std::thread worker;
+
+    // depth is how many frames may wait for the writer before push() blocks
+    FrameWriter(std::string target, int _width, int _height, size_t _depth = 8) {
+        width = _width;
+        height = _height;
+        depth = _depth;
+        written = 0;
+        failed = false;
+        closing = false;
+        if (target == "-") {
+            format = FORMAT_RAW;
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        }
+        else {
+            size_t dot = target.rfind('.');
+            std::string ext = dot == std::string::npos ? "" : target.substr(dot);
+            format = (ext == ".png" || ext == ".PNG") ? FORMAT_PNG : FORMAT_PPM;
+            if (target.find('%') == std::string::npos) {
+                target = dot == std::string::npos ? target + "-%05d.ppm" : target.substr(0, dot) + "-%05d" + ext;
+            }
+        }
+        pattern = target;
+        worker = std::thread(&FrameWriter::run, this);
+    }
+    ~FrameWriter() {
+        close();
+    }
+
+    // Queues the frame in rgba (width * height * 4 bytes, top row first) and hands back a spent buffer in
+    // its place, so a steady capture allocates nothing
+    void push(std::vector<unsigned char> & rgba) {
+        std::unique_lock<std::mutex> guard(lock);
+        while (queue.size() >= depth) {
+            changed.wait(guard);
+        }
+        queue.push_back(std::vector<unsigned char>());
+        queue.back().swap(rgba);
+        if (!spare.empty()) {
+            rgba.swap(spare.back());
+            spare.pop_back();
+        }
+        changed.notify_all();
+    }
+
+    // Writes out what is queued and stops the thread
+    void close() {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            if (closing) {
+                return;
+            }
+            closing = true;
+            changed.notify_all();
+        }
+        worker.join();
+        if (format == FORMAT_RAW) {
+            fflush(stdout);
+        }
+    }
+
+    void run() {
+        std::vector<unsigned char> frame, rows;
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            while (queue.empty() && !closing) {
+                changed.wait(guard);
+            }
+            if (queue.empty()) {
+                break;
+            }
+            frame.swap(queue.front());
+            queue.pop_front();
+            changed.notify_all();
+            guard.unlock();
+
+            if (!failed && !write(frame, rows)) {
+                std::cerr << "FrameWriter: failed to write frame " << written << " to " << pattern << std::endl;
+                failed = true;
+            }
+            written++;
+
+            guard.lock();
+            spare.push_back(std::vector<unsigned char>());
+            spare.back().swap(frame);
+        }
+    }
+
+    bool write(const std::vector<unsigned char> & rgba, std::vector<unsigned char> & rows) {
+        if (format == FORMAT_RAW) {
+            return fwrite(&rgba[0], 1, rgba.size(), stdout) == rgba.size();
+        }
+        char path[1024];
+        snprintf(path, sizeof(path), pattern.c_str(), (int)written);
+        std::ofstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        if (format == FORMAT_PPM) {
+            rows.resize((size_t)width * height * 3);
+            for (size_t i=0; i<(size_t)width * height; i++) {
+                memcpy(&rows[i * 3], &rgba[i * 4], 3);
+            }
+            file << "P6\n" << width << " " << height << "\n255\n";
+            file.write((const char *)&rows[0], rows.size());
+        }
+        else {
+            writePNG(file, rgba, rows);
+        }
+        return (bool)file;
+    }
+
+    // An 8-bit RGBA PNG whose zlib stream uses stored (uncompressed) deflate blocks: larger files, but no
+    // compression library and next to no CPU per frame
+    void writePNG(std::ofstream & file, const std::vector<unsigned char> & rgba, std::vector<unsigned char> & rows) {
+        size_t row = (size_t)width * 4;
+        rows.resize((row + 1) * height);
+        for (int y=0; y<height; y++) {
+            rows[y * (row + 1)] = 0; // filter: none
+            memcpy(&rows[y * (row + 1) + 1], &rgba[y * row], row);
+        }
+
+        static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        file.write((const char *)signature, 8);
+
+        std::vector<unsigned char> chunk;
+        putU32(chunk, width);
+        putU32(chunk, height);
+        chunk.push_back(8); // bit depth
+        chunk.push_back(6); // colour type: RGBA
+        chunk.push_back(0);
+        chunk.push_back(0);
+        chunk.push_back(0);
+        writeChunk(file, "IHDR", chunk);
+
+        chunk.clear();
+        chunk.push_back(0x78);
+        chunk.push_back(0x01);
+        for (size_t at=0; at<rows.size(); ) {
+            size_t n = std::min(rows.size() - at, (size_t)65535);
+            chunk.push_back(at + n == rows.size() ? 1 : 0);
+            chunk.push_back(n & 0xff);
+            chunk.push_back(n >> 8);
+            chunk.push_back(~n & 0xff);
+            chunk.push_back((~n >> 8) & 0xff);
+            chunk.insert(chunk.end(), rows.begin() + at, rows.begin() + at + n);
+            at += n;
+        }
+        unsigned int a = 1, b = 0;
+        for (size_t i=0; i<rows.size(); i++) {
+            a = (a + rows[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        putU32(chunk, (b << 16) | a);
+        writeChunk(file, "IDAT", chunk);
+
+        chunk.clear();
+        writeChunk(file, "IEND", chunk);
+    }
+
+    static void putU32(std::vector<unsigned char> & out, unsigned int v) {
+        out.push_back(v >> 24);
+        out.push_back((v >> 16) & 0xff);
+        out.push_back((v >> 8) & 0xff);
+        out.push_back(v & 0xff);
+    }
+
+    static void writeChunk(std::ofstream & file, const char * type, const std::vector<unsigned char> & data) {
+        std::vector<unsigned char> head;
+        putU32(head, (unsigned int)data.size());
+        head.insert(head.end(), type, type + 4);
+        file.write((const char *)&head[0], 8);
+        if (!data.empty()) {
+            file.write((const char *)&data[0], data.size());
+        }
+        unsigned int crc = crc32(0xffffffffu, (const unsigned char *)type, 4);
+        crc = crc32(crc, data.empty() ? NULL : &data[0], data.size()) ^ 0xffffffffu;
+        std::vector<unsigned char> tail;
+        putU32(tail, crc);
+        file.write((const char *)&tail[0], 4);
+    }
+
+    static unsigned int crc32(unsigned int crc, const unsigned char * data, size_t n) {
+        static unsigned int table[256];
+        static bool init = false;
+        if (!init) {
+            for (unsigned int i=0; i<256; i++) {
+                unsigned int c = i;
+                for (int k=0; k<8; k++) {
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                }
+                table[i] = c;
+            }
+            init = true;
+        }
+        for (size_t i=0; i<n; i++) {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <GLFW/glfw3.h>
+#include <vector>
+#include <cstddef>
+
+#ifdef _WIN32
+#define GL_UPLOAD_CALL __stdcall
+#else
+#define GL_UPLOAD_CALL
+#endif
+
+// Uploads host RGBA8 frames into a GL texture through two pixel buffer objects, for when OpenCL can't
+// write the texture itself (no cl_khr_gl_sharing, e.g. CPU devices). The copy into one buffer overlaps the
+// DMA of the other into the texture. Without buffer objects (GL before 2.1) it falls back to a plain
+// glTexSubImage2D from host memory.
+class GLPixelUpload {
+public:
+    typedef void (GL_UPLOAD_CALL * GenBuffersProc)(GLsizei, GLuint *);
+    typedef void (GL_UPLOAD_CALL * DeleteBuffersProc)(GLsizei, const GLuint *);
+    typedef void (GL_UPLOAD_CALL * BindBufferProc)(GLenum, GLuint);
+    typedef void (GL_UPLOAD_CALL * BufferDataProc)(GLenum, ptrdiff_t, const void *, GLenum);
+    typedef void * (GL_UPLOAD_CALL * MapBufferProc)(GLenum, GLenum);
+    typedef GLboolean (GL_UPLOAD_CALL * UnmapBufferProc)(GLenum);
+
+    enum {
+        PIXEL_UNPACK_BUFFER = 0x88EC,
+        STREAM_DRAW = 0x88E0,
+        WRITE_ONLY = 0x88B9
+    };
+
+    GenBuffersProc genBuffers;
+    DeleteBuffersProc deleteBuffers;
+    BindBufferProc bindBuffer;
+    BufferDataProc bufferData;
+    MapBufferProc mapBuffer;
+    UnmapBufferProc unmapBuffer;
+
+    GLuint pbo[2];
+    int next;
+    bool usePBO;
+    void * mapped;
+    std::vector<unsigned char> staging;
+
+    // Needs the current GL context
+    GLPixelUpload() {
+        genBuffers = (GenBuffersProc)glfwGetProcAddress("glGenBuffers");
+        deleteBuffers = (DeleteBuffersProc)glfwGetProcAddress("glDeleteBuffers");
+        bindBuffer = (BindBufferProc)glfwGetProcAddress("glBindBuffer");
+        bufferData = (BufferDataProc)glfwGetProcAddress("glBufferData");
+        mapBuffer = (MapBufferProc)glfwGetProcAddress("glMapBuffer");
+        unmapBuffer = (UnmapBufferProc)glfwGetProcAddress("glUnmapBuffer");
+        usePBO = genBuffers != NULL && deleteBuffers != NULL && bindBuffer != NULL && bufferData != NULL &&
+                 mapBuffer != NULL && unmapBuffer != NULL;
+        if (usePBO) {
+            genBuffers(2, pbo);
+        }
+        next = 0;
+        mapped = NULL;
+    }
+    ~GLPixelUpload() {
+        if (usePBO) {
+            deleteBuffers(2, pbo);
+        }
+    }
+
+    // Where to write the next width x height frame, rows tightly packed; finish with end()
+    unsigned char * begin(size_t width, size_t height) {
+        size_t size = width * height * 4;
+        if (usePBO) {
+            bindBuffer(PIXEL_UNPACK_BUFFER, pbo[next]);
+            // orphaning the old storage lets GL keep reading it for an upload still in flight
+            bufferData(PIXEL_UNPACK_BUFFER, (ptrdiff_t)size, NULL, STREAM_DRAW);
+            mapped = mapBuffer(PIXEL_UNPACK_BUFFER, WRITE_ONLY);
+            bindBuffer(PIXEL_UNPACK_BUFFER, 0);
+            if (mapped != NULL) {
+                return (unsigned char *)mapped;
+            }
+        }
+        staging.resize(size);
+        return &staging[0];
+    }
+
+    // Copies the frame into the top-left corner of tex
+    void end(GLuint tex, size_t width, size_t height) {
+        glBindTexture(GL_TEXTURE_2D, tex);
+        if (mapped != NULL) {
+            bindBuffer(PIXEL_UNPACK_BUFFER, pbo[next]);
+            unmapBuffer(PIXEL_UNPACK_BUFFER);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (GLsizei)width, (GLsizei)height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            bindBuffer(PIXEL_UNPACK_BUFFER, 0);
+            mapped = NULL;
+            next ^= 1;
+        }
+        else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (GLsizei)width, (GLsizei)height, GL_RGBA, GL_UNSIGNED_BYTE, &staging[0]);
+        }
+    }
+};
@@ -2,6 +2,30 @@
 #define TO_FIXED(_X) ((int)((_X) * FP_SCALE))
 #define TO_FLOAT(_X) ((float)((_X) / FP_SCALE))
 
+// Specialisation: when the host builds with these defined, the constant replaces the runtime argument
+// of the same name in every kernel and helper (the argument is still passed, under another name), so
+// index math folds to shifts and masks for power-of-two sizes and bounds checks compare to immediates
+#ifdef GRID_W
+#define grid_size ((int2)(GRID_W, GRID_H))
+#define GRID_SIZE_ARG grid_size_dynamic
+#else
+#define GRID_SIZE_ARG grid_size
+#endif
+
+#ifdef GRAVITY
+#define gravity GRAVITY
+#define GRAVITY_ARG gravity_dynamic
+#else
+#define GRAVITY_ARG gravity
+#endif
+
+#ifdef NUM_TRACE
+#define num_trace NUM_TRACE
+#define NUM_TRACE_ARG num_trace_dynamic
+#else
+#define NUM_TRACE_ARG num_trace
+#endif
+
 typedef struct __attribute__((packed)) _Particle {
     int id;
     float2 position;
@@ -12,16 +36,6 @@ typedef struct __attribute__((packed)) _Particle {
     float4 types; // 12 // x:rock, y:oil, z:fire/smoke, w:water/steam
 } Particle;
 
-typedef struct __attribute__((packed)) _GridCell {
-    int mass;
-    int heat;
-    int2 velocity; // 4
-    int4 types; // 8 // x:rock, y:oil, z:fire/smoke, w:water/steam
-    int maxID;
-    int trace;
-    int2 dummy; // 12
-} GridCell;
-
 typedef struct __attribute__((packed)) _Trace {
     int num;
     float2 position;
@@ -37,54 +51,710 @@ typedef struct __attribute__((packed)) _Player {
     int dummy; // 8
 } Player;
 
-__kernel void clear_grids( __global GridCell * grid,
-                           int2 grid_size ) {
+typedef struct __attribute__((packed)) _Emitter {
+    float2 position;
+    float2 velocity; // 4
+    float2 velocity_range;
+    float spread;
+    float scale_range; // 8
+    float radius;
+    float mass;
+    float heat;
+    int first; // 12
+    int count;
+    int burst;
+    int follow;
+    int dummy; // 16
+    float4 types; // 20
+} Emitter;
+
+// The grid is stored sparsely in PAGE_SIZE x PAGE_SIZE cell pages. page_table maps each page of the
+// full grid to a slot in the page pool (or -1), page_list maps pool slots back to pages and
+// page_info holds (pages in use, pool capacity, release candidate, candidate holds rock). A page that
+// no particle or trace has touched for PAGE_IDLE_FRAMES frames and holds no baked rock is released,
+// one per frame, by moving the last slot into its place, so the resident slots stay contiguous.
+
+#define PAGE_BITS 5
+#define PAGE_SIZE (1 << PAGE_BITS)
+#define PAGE_CELLS (PAGE_SIZE * PAGE_SIZE)
+
+int pagesX ( int2 GRID_SIZE_ARG ) {
+    return (grid_size.x + PAGE_SIZE - 1) >> PAGE_BITS;
+}
+
+int cellIndex ( __global int * pages, int2 GRID_SIZE_ARG, int x, int y ) {
+    int slot = pages[(y >> PAGE_BITS) * pagesX(grid_size) + (x >> PAGE_BITS)];
+    if (slot < 0) {
+        return -1;
+    }
+    return (slot << (PAGE_BITS * 2)) + ((y & (PAGE_SIZE - 1)) << PAGE_BITS) + (x & (PAGE_SIZE - 1));
+}
+
+int residentCells ( __global int * page_info ) {
+    return min(page_info[0], page_info[1]) * PAGE_CELLS;
+}
+
+// Each pool is stored as one int plane per channel, grid_stride cells apart. Types (x:rock, y:oil,
+// z:fire/smoke, w:water/steam) are unsigned TYPE_BITS lanes. With GRID_PACKED (the sorted build, which
+// writes every cell once) velocity is packed as two signed 16 bit lanes and both are saturated when
+// packed. update_grids sums straight into the pool with atomics instead, so there velocity keeps two
+// full planes and types are 16 bit lanes: a lane only carries into the next past 255 particles' worth
+// of one type on a cell.
+
+// The layout defines come from the host, see kernelDefines in main.cpp
+#if !defined(TYPE_BITS) || !defined(GRID_PACKED) || !defined(GRID_MAXID) || !defined(GRID_PLANES)
+#error "grid layout defines missing"
+#endif
+#if TYPE_BITS == 8
+#define TYPE_WORDS 1
+#define TYPE_SCALE 16.
+#else
+#define TYPE_WORDS 2
+#define TYPE_SCALE 256.
+#endif
+#define TYPE_MAX ((1 << TYPE_BITS) - 1)
+#define TYPE_FIXED(_X) ((int)((_X) * TYPE_SCALE))
+// The rock lane is what hasRock() and the rock mask test, so a contribution the full precision grid
+// counted (TO_FIXED > 0, rock of 0.001 or more) keeps at least one unit instead of truncating to zero:
+// thin rock still collides. One unit is 1/256 with 16 bit lanes, under the 0.01 rock thresholds in
+// stepParticle; with 8 bit lanes it is 1/16, so rock between 0.001 and 1/16 reads as 1/16 there.
+#define ROCK_FIXED(_X) max(TYPE_FIXED(_X), TO_FIXED(_X) > 0 ? 1 : 0)
+#define VEL_SCALE 16.
+#define VEL_FIXED(_X) ((int)((_X) * VEL_SCALE))
+
+#if GRID_PACKED
+#define VEL_WORDS 1
+#else
+#define VEL_WORDS 2
+#if TYPE_BITS != 16
+#error "the atomic grid build needs 16 bit type lanes"
+#endif
+#endif
+
+#define GRID_MASS 0
+#define GRID_HEAT 1
+#define GRID_TRACE 3
+#define GRID_VEL 4
+#define GRID_TYPES (GRID_VEL + VEL_WORDS)
+#if GRID_MAXID != 2 || GRID_PLANES != GRID_TYPES + TYPE_WORDS
+#error "host grid layout does not match GRID_* in kernels/main.cl"
+#endif
+
+#define GRID(_P, _I) grid[(_P) * grid_stride + (_I)]
+
+int packVelocity ( int2 v ) {
+    v = clamp(v, (int2)(-32768), (int2)(32767));
+    return v.x + v.y * 65536;
+}
+
+float2 unpackVelocity ( int w ) {
+    int x = ((w & 0xFFFF) ^ 0x8000) - 0x8000;
+    return (float2)((float)x, (float)((w - x) >> 16)) / (float2)(VEL_SCALE);
+}
+
+uint2 packTypes ( int4 t ) {
+    uint4 u = convert_uint4(clamp(t, (int4)(0), (int4)(TYPE_MAX)));
+#if TYPE_BITS == 8
+    return (uint2)(u.x | (u.y << 8) | (u.z << 16) | (u.w << 24), 0);
+#else
+    return (uint2)(u.x | (u.y << 16), u.z | (u.w << 16));
+#endif
+}
+
+float4 unpackTypes ( uint w0, uint w1 ) {
+#if TYPE_BITS == 8
+    uint4 t = (uint4)(w0 & 0xFF, (w0 >> 8) & 0xFF, (w0 >> 16) & 0xFF, w0 >> 24);
+#else
+    uint4 t = (uint4)(w0 & 0xFFFF, w0 >> 16, w1 & 0xFFFF, w1 >> 16);
+#endif
+    return convert_float4(t) / (float4)(TYPE_SCALE);
+}
+
+// Velocity of a cell in packed form, whatever the layout
+int readVelocityWord ( __global int * grid, int grid_stride, int index ) {
+#if GRID_PACKED
+    return GRID(GRID_VEL, index);
+#else
+    return packVelocity((int2)(GRID(GRID_VEL, index), GRID(GRID_VEL + 1, index)));
+#endif
+}
+
+float2 readVelocity ( __global int * grid, int grid_stride, int index ) {
+#if GRID_PACKED
+    return unpackVelocity(GRID(GRID_VEL, index));
+#else
+    return (float2)((float)GRID(GRID_VEL, index), (float)GRID(GRID_VEL + 1, index)) / (float2)(VEL_SCALE);
+#endif
+}
+
+void writeVelocity ( __global int * grid, int grid_stride, int index, int2 v ) {
+#if GRID_PACKED
+    GRID(GRID_VEL, index) = packVelocity(v);
+#else
+    GRID(GRID_VEL, index) = v.x;
+    GRID(GRID_VEL + 1, index) = v.y;
+#endif
+}
+
+float4 readTypes ( __global int * grid, int grid_stride, int index ) {
+    return unpackTypes((uint)GRID(GRID_TYPES, index), TYPE_WORDS > 1 ? (uint)GRID(GRID_TYPES + 1, index) : 0);
+}
+
+
+// Footprint tables, built on the host (ensureFootprintRadius). Radii are rounded up to RADIUS_STEP
+// classes; footprint[0] is the number of classes and footprint[1 + class] the offset of that class's
+// spans. Each class holds FOOT_VARIANTS x (2 * reach + 1) rows, one per quarter-cell position of the
+// particle plus one for integer offsets (FOOT_CENTRED), each packing the conservative [first, last]
+// column of the row. weights holds WEIGHT_LUT + 1 samples of sqrt(1 - sqrt(q)) followed by 1 - sqrt(q),
+// where q is the squared distance over the squared radius.
+
+#define RADIUS_STEP 0.25f
+#define FOOT_SUBCELLS 4
+#define FOOT_CENTRED (FOOT_SUBCELLS * FOOT_SUBCELLS)
+#define FOOT_VARIANTS (FOOT_CENTRED + 1)
+#define WEIGHT_LUT 512
+#define WEIGHT_SPLAT 0
+#define WEIGHT_GATHER 1
+
+int footClass ( float radius ) {
+    return (int)ceil(radius / RADIUS_STEP);
+}
+
+int footReach ( int cls ) {
+    return (int)ceil((float)cls * RADIUS_STEP + 1.f);
+}
+
+int footVariant ( float fx, float fy ) {
+    return min((int)(fx * FOOT_SUBCELLS), FOOT_SUBCELLS - 1) + min((int)(fy * FOOT_SUBCELLS), FOOT_SUBCELLS - 1) * FOOT_SUBCELLS;
+}
+
+// Columns of row dy that can fall inside the footprint, or the whole row for radii past the table
+int2 footSpan ( __constant int * footprint, int cls, int variant, int dy ) {
+    int reach = footReach(cls);
+    if (cls >= footprint[0]) {
+        return (int2)(-reach, reach);
+    }
+    int span = footprint[footprint[1 + cls] + variant * (reach * 2 + 1) + dy + reach];
+    return (int2)((span >> 8) - 128, (span & 0xFF) - 128);
+}
+
+float footWeight ( __constant float * weights, int curve, float q ) {
+    float f = q * (float)WEIGHT_LUT;
+    int k = min((int)f, WEIGHT_LUT - 1);
+    __constant float * w = weights + curve * (WEIGHT_LUT + 1);
+    return mix(w[k], w[k + 1], f - (float)k);
+}
+
+// Static rock layer: cold, motionless rock is baked into its own planes on the same page slots as the
+// grid pools and merged into grid reads, so it is not splatted every frame. baked[slot] tracks each
+// particle: update_particles asks for a bake once a rock is cold and for an unbake once it heats up,
+// and mark_pages carries the request out on the next frame, so the rock is counted exactly once.
+
+#define ROCK_MASS 0
+#define ROCK_TYPE 1
+#define ROCK_MAXID 2
+#define ROCK_PLANES 3
+
+#define BAKE_NONE 0
+#define BAKE_DONE 1
+#define BAKE_PENDING 2
+#define UNBAKE_PENDING 3
+
+#define ROCK(_P, _I) rock_layer[(_P) * grid_stride + (_I)]
+
+bool hasRock ( __global int * grid, __global int * rock_layer, int grid_stride, int index ) {
+    return (GRID(GRID_TYPES, index) & TYPE_MAX) > 0 || ROCK(ROCK_TYPE, index) > 0;
+}
+
+bool footprintResident ( __global int * pages, int2 GRID_SIZE_ARG, Particle P ) {
+    int xc = (int)floor(P.position.x);
+    int yc = (int)floor(P.position.y);
+    int r = footReach(footClass(P.radius));
+    int x0 = max(xc - r, 0), x1 = min(xc + r, grid_size.x - 1);
+    int y0 = max(yc - r, 0), y1 = min(yc + r, grid_size.y - 1);
+    for (int py=(y0 >> PAGE_BITS); py<=(y1 >> PAGE_BITS); py++) {
+        for (int px=(x0 >> PAGE_BITS); px<=(x1 >> PAGE_BITS); px++) {
+            if (pages[py * pagesX(grid_size) + px] < 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Adds (sign 1) or takes back (sign -1) a rock particle's footprint in the static layer
+void splatRock ( __global int * rock_layer,
+                 int grid_stride,
+                 __global int * pages,
+                 int2 GRID_SIZE_ARG,
+                 __constant int * footprint,
+                 __constant float * weights,
+                 Particle P,
+                 int sign ) {
+    int xc = (int)floor(P.position.x);
+    int yc = (int)floor(P.position.y);
+    float fx = P.position.x - (float)xc, fy = P.position.y - (float)yc;
+    int cls = footClass(P.radius);
+    int r = footReach(cls);
+    int variant = footVariant(fx, fy);
+    float invR2 = 1.f / (P.radius * P.radius);
+
+    for (int j=-r; j<=r; j++) {
+        int y = yc + j;
+        if (y < 0 || y >= grid_size.y) {
+            continue;
+        }
+        int2 span = footSpan(footprint, cls, variant, j);
+        float dy = (float)j + 0.5f - fy;
+        for (int i=max(span.x, -xc); i<=min(span.y, grid_size.x - 1 - xc); i++) {
+            float dx = (float)i + 0.5f - fx;
+            float q = (dx*dx + dy*dy) * invR2;
+            int grid_index = cellIndex(pages, grid_size, xc + i, y);
+            if (q < 1.f && grid_index >= 0) {
+                float t = footWeight(weights, WEIGHT_SPLAT, q);
+                atomic_add(&ROCK(ROCK_MASS, grid_index), sign * TO_FIXED(P.mass * t));
+                atomic_add(&ROCK(ROCK_TYPE, grid_index), sign * ROCK_FIXED(P.types.x * t));
+                if (sign > 0) {
+                    atomic_max(&ROCK(ROCK_MAXID, grid_index), P.id);
+                }
+            }
+        }
+    }
+}
+
+// Only used on level reset
+__kernel void clear_rock_layer( __global int * rock_layer,
+                                int grid_stride,
+                                __global int * page_info ) {
     int id = get_global_id(0);
-    int n = grid_size.x * grid_size.y;
+    int n = residentCells(page_info);
 
     if (id < n) {
-        __global int * GC = (__global int*)(grid + id);
-        GC[0] = GC[1] = GC[2] = GC[3] = GC[4] = GC[5] = GC[6] = GC[7] = 0;
-        GC[8] = -1;
-        GC[9] = 0;
+        ROCK(ROCK_MASS, id) = 0;
+        ROCK(ROCK_TYPE, id) = 0;
+        ROCK(ROCK_MAXID, id) = -1;
     }
 }
 
-__kernel void update_grids( __global Particle * particles,
-                            __global GridCell * grid,
-                            int num_particles,
-                            int2 grid_size ) {
+// Live particle list: active[0] and active[1] are append counters used on alternate frames (parity)
+// and active[ACTIVE_LIST + i] is the slot of the i-th live particle. Per-particle kernels are launched
+// over an upper bound of the count and map their id through activeSlot.
+
+#define ACTIVE_LIST 2
+
+int activeSlot ( __global int * active, int parity, int id ) {
+    return id < active[parity] ? active[ACTIVE_LIST + id] : -1;
+}
+
+// Free slot stack: free_list[0] is the number of free slots and free_list[FREE_LIST + i] the i-th one.
+// update_particles pushes the slot of every particle that dies and emit_particles pops from it. The
+// host grows the pool before a launch could run the stack dry, so a failed pop only happens at the
+// -particles limit, where the spawn is dropped instead of overwriting a live particle.
+
+#define FREE_LIST 1
+
+void freeSlot ( __global int * free_list, int slot ) {
+    free_list[FREE_LIST + atomic_inc(free_list)] = slot;
+}
+
+int allocSlot ( __global int * free_list ) {
+    int top = atomic_dec(free_list) - 1;
+    return top >= 0 ? free_list[FREE_LIST + top] : -1;
+}
+
+// Pushes the slots added by a pool resize
+__kernel void free_slots( __global int * free_list,
+                          int first,
+                          int count ) {
+    int id = get_global_id(0);
+
+    if (id < count) {
+        freeSlot(free_list, first + count - 1 - id);
+    }
+}
+
+__kernel void compact_particles( __global Particle * particles,
+                                 int num_particles,
+                                 __global int * active,
+                                 int parity,
+                                 __global int * free_list ) {
+    __local int groupCount;
+    __local int groupBase;
+
+    int id = get_global_id(0);
+    int lid = get_local_id(0);
+
+    if (lid == 0) {
+        groupCount = 0;
+    }
+    if (id == 0) {
+        // last frame's counter is free again; it collects next frame's list
+        active[1 - parity] = 0;
+        // pops that came up empty leave the count below zero
+        free_list[0] = max(free_list[0], 0);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    bool live = id < num_particles && particles[id].id >= 0;
+    int rank = live ? atomic_inc(&groupCount) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid == 0) {
+        groupBase = atomic_add(active + parity, groupCount);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (live) {
+        active[ACTIVE_LIST + groupBase + rank] = id;
+    }
+}
+
+// Level generation's particles, uploaded in one transfer (see flushSpawns in main.cpp)
+__kernel void spawn_particles( __global Particle * particles,
+                               __global Particle * spawned,
+                               int num_spawned,
+                               __global int * free_list ) {
+    int id = get_global_id(0);
+    if (id >= num_spawned) {
+        return;
+    }
+
+    Particle P = spawned[id];
+    P.id = allocSlot(free_list);
+    if (P.id >= 0) {
+        particles[P.id] = P;
+    }
+}
+
+// Emitters spawn into slots popped from the free list. The host lays the emitters out back to back
+// (first, count) and launches one work-item per particle, so nothing is read back. Random numbers
+// are a hash of (seed, emitter, particle, n), so a frame is reproducible from its seed. Particles in
+// the same burst share the velocity draw.
+
+#define EMIT_FIXED 0
+#define EMIT_PLAYER 1 // at the player
+#define EMIT_AIM 2    // at the player, aimed at the target argument
+
+// Launch and spray velocity towards a world-space target, capped at 400; zero when the target is
+// within half a unit of the player
+float2 aimVelocity ( float2 target, float2 pos ) {
+    float2 vel = (target - pos) * 2.f;
+    float speed = length(vel);
+    if (speed <= 1.f) {
+        return (float2)(0.f, 0.f);
+    }
+    return speed > 400.f ? vel * (400.f / speed) : vel;
+}
+
+uint hashInt ( uint x ) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+float emitRand ( uint seed, uint key, uint n ) {
+    return (float)(hashInt(hashInt(seed ^ (key * 0x9e3779b9U)) + n) >> 8) * (1.f / 16777216.f);
+}
+
+__kernel void emit_particles( __global Particle * particles,
+                              __constant Emitter * emitters,
+                              int num_emitters,
+                              int num_emit,
+                              __global int * free_list,
+                              __global Player * player,
+                              float2 target,
+                              int seed ) {
     int id = get_global_id(0);
+    if (id >= num_emit) {
+        return;
+    }
 
-    if (id < num_particles) {
+    int e = 0;
+    while (e < (num_emitters - 1) && id >= (emitters[e].first + emitters[e].count)) {
+        e++;
+    }
+    Emitter E = emitters[e];
+    float2 aim = (float2)(0.f, 0.f);
+    if (E.follow == EMIT_AIM) {
+        aim = aimVelocity(target, player->pos);
+        if (aim.x == 0.f && aim.y == 0.f) {
+            return;
+        }
+        aim += player->vel;
+    }
+    int k = id - E.first;
+    uint burstKey = ((uint)e << 16) | (uint)(k / max(E.burst, 1));
+    uint key = ((uint)e << 16) | (uint)k;
+
+    float2 pos = E.follow == EMIT_FIXED ? E.position : player->pos;
+    float2 vel = E.follow == EMIT_AIM ? aim : E.velocity;
+    vel += E.velocity_range * (float2)(emitRand((uint)seed, burstKey, 0), emitRand((uint)seed, burstKey, 1));
+    vel *= 1.f + E.scale_range * emitRand((uint)seed, key, 2);
+
+    Particle P;
+    P.id = allocSlot(free_list);
+    if (P.id < 0) {
+        return;
+    }
+    P.position = pos + E.spread * (float2)(emitRand((uint)seed, key, 3) * 2.f - 1.f, emitRand((uint)seed, key, 4) * 2.f - 1.f);
+    P.radius = E.radius;
+    P.velocity = vel;
+    P.mass = E.mass;
+    P.heat = E.heat;
+    P.types = E.types;
+    particles[P.id] = P;
+}
 
+__kernel void mark_pages( __global Particle * particles,
+                          __global int * active,
+                          int parity,
+                          int2 GRID_SIZE_ARG,
+                          __global int * page_flags,
+                          __global int * baked,
+                          __global int * rock_layer,
+                          int grid_stride,
+                          __global int * pages,
+                          __constant int * footprint,
+                          __constant float * weights ) {
+    int id = activeSlot(active, parity, get_global_id(0));
+
+    if (id >= 0) {
         Particle P = particles[id];
         if (P.id < 0) {
             return;
         }
+        int bake = baked[id];
+        if (bake == BAKE_DONE) {
+            return;
+        }
+        if (bake == BAKE_PENDING) {
+            if (footprintResident(pages, grid_size, P)) {
+                splatRock(rock_layer, grid_stride, pages, grid_size, footprint, weights, P, 1);
+                baked[id] = BAKE_DONE;
+                return;
+            }
+            baked[id] = BAKE_NONE;
+        }
+        else if (bake == UNBAKE_PENDING) {
+            splatRock(rock_layer, grid_stride, pages, grid_size, footprint, weights, P, -1);
+            baked[id] = BAKE_NONE;
+        }
         int xc = (int)floor(P.position.x);
         int yc = (int)floor(P.position.y);
         int r = (int)ceil(P.radius + 1.);
+        int x0 = max(xc - r, 0), x1 = min(xc + r, grid_size.x - 1);
+        int y0 = max(yc - r, 0), y1 = min(yc + r, grid_size.y - 1);
+        if (x0 > x1 || y0 > y1) {
+            return;
+        }
+        for (int py=(y0 >> PAGE_BITS); py<=(y1 >> PAGE_BITS); py++) {
+            for (int px=(x0 >> PAGE_BITS); px<=(x1 >> PAGE_BITS); px++) {
+                page_flags[py * pagesX(grid_size) + px] = 1;
+            }
+        }
+    }
+}
 
-        for (int x=xc - r; x<=(xc + r); x++) {
-            for (int y=yc - r; y<=(yc + r); y++) {
-                if (x >= 0 && y >= 0 && x < grid_size.x && y < grid_size.y) {
-                    float dx = ((float)(x) + 0.5) - P.position.x, dy = ((float)(y) + 0.5) - P.position.y;
-                    float t = 1. - sqrt(dx*dx+dy*dy) / P.radius;
-                    if (t > 0.) {
-                        t = (float)pow((double)t, 0.5);
-                        int grid_index = y * grid_size.x + x;
-                        __global int * GC = (__global int*)(grid + grid_index);
-                        atomic_add(GC + 0, TO_FIXED(P.mass * t));
-                        atomic_add(GC + 1, TO_FIXED(P.heat * t));
-                        atomic_add(GC + 2, TO_FIXED(P.velocity.x * t));
-                        atomic_add(GC + 3, TO_FIXED(P.velocity.y * t));
-                        atomic_add(GC + 4, TO_FIXED(P.types.x * t));
-                        atomic_add(GC + 5, TO_FIXED(P.types.y * t));
-                        atomic_add(GC + 6, TO_FIXED(P.types.z * t));
-                        atomic_add(GC + 7, TO_FIXED(P.types.w * t));
-                        atomic_max(GC + 8, P.id);
-                    }
+#define PAGE_IDLE_FRAMES 120
+// page_idle of a candidate found to hold baked rock; it is nominated again only after a particle touches it
+#define PAGE_PINNED (-(1 << 30))
+
+__kernel void alloc_pages( __global int * page_flags,
+                           __global int * page_table,
+                           __global int * page_list,
+                           __global int * page_info,
+                           int num_pages,
+                           __global int * page_touched,
+                           __global int * page_idle ) {
+    int id = get_global_id(0);
+
+    if (id < num_pages) {
+        if (page_flags[id] && page_table[id] < 0) {
+            int slot = atomic_inc(page_info);
+            if (slot < page_info[1]) {
+                page_table[id] = slot;
+                page_list[slot] = id;
+            }
+        }
+        // bit 0 of page_touched also holds last frame's update_trace
+        if (page_flags[id] || (page_touched[id] & 1)) {
+            page_idle[id] = 0;
+        }
+        else if (page_table[id] >= 0 && ++page_idle[id] >= PAGE_IDLE_FRAMES) {
+            atomic_cmpxchg(page_info + 2, -1, id);
+        }
+        page_touched[id] = ((page_touched[id] << 1) | (page_flags[id] ? 1 : 0)) & 3;
+        page_flags[id] = 0;
+    }
+}
+
+__kernel void reset_pages( __global int * page_flags,
+                           __global int * page_table,
+                           __global int * page_info,
+                           int num_pages,
+                           __global int * page_touched,
+                           __global int * page_idle ) {
+    int id = get_global_id(0);
+
+    if (id < num_pages) {
+        page_flags[id] = 0;
+        page_touched[id] = 0;
+        page_table[id] = -1;
+        page_idle[id] = 0;
+    }
+    if (id == 0) {
+        page_info[0] = 0;
+        page_info[2] = -1;
+        page_info[3] = 0;
+    }
+}
+
+void clearCell ( __global int * grid, int grid_stride, int index ) {
+    for (int p=0; p<GRID_PLANES; p++) {
+        GRID(p, index) = p == GRID_MAXID ? -1 : 0;
+    }
+}
+
+// Only used on level reset; during play the stale grid is cleared by update_particles
+__kernel void clear_grids( __global int * grid,
+                           int grid_stride,
+                           __global int * page_info ) {
+    int id = get_global_id(0);
+    int n = residentCells(page_info);
+
+    if (id < n) {
+        clearCell(grid, grid_stride, id);
+    }
+}
+
+// The page release, after alloc_pages: check_page_release and release_page run one work-item per cell
+// of the candidate page, finish_page_release a single one. Not while the pool is overfull (the host
+// is about to grow it).
+bool releasing ( __global int * page_info ) {
+    return page_info[2] >= 0 && page_info[0] <= page_info[1];
+}
+
+__kernel void check_page_release( __global int * page_table,
+                                  __global int * page_info,
+                                  __global int * rock_layer,
+                                  int grid_stride ) {
+    int id = get_global_id(0);
+
+    if (id < PAGE_CELLS && releasing(page_info)) {
+        int index = (page_table[page_info[2]] << (PAGE_BITS * 2)) + id;
+        if (ROCK(ROCK_TYPE, index) > 0) {
+            page_info[3] = 1;
+        }
+    }
+}
+
+// Moves the last slot's rock into the candidate's slot and clears the last slot in the rock layer and
+// both grid pools, which are only cleared up to the page count from here on
+__kernel void release_page( __global int * page_table,
+                            __global int * page_info,
+                            __global int * rock_layer,
+                            __global int * grid,
+                            __global int * stale_grid,
+                            int grid_stride ) {
+    int id = get_global_id(0);
+
+    if (id < PAGE_CELLS && releasing(page_info) && !page_info[3]) {
+        int to = (page_table[page_info[2]] << (PAGE_BITS * 2)) + id;
+        int from = ((page_info[0] - 1) << (PAGE_BITS * 2)) + id;
+        for (int p=0; p<ROCK_PLANES; p++) {
+            ROCK(p, to) = ROCK(p, from);
+        }
+        if (from != to) {
+            ROCK(ROCK_MASS, from) = 0;
+            ROCK(ROCK_TYPE, from) = 0;
+            ROCK(ROCK_MAXID, from) = -1;
+        }
+        clearCell(grid, grid_stride, from);
+        clearCell(stale_grid, grid_stride, from);
+    }
+}
+
+__kernel void finish_page_release( __global int * page_table,
+                                   __global int * page_list,
+                                   __global int * page_info,
+                                   __global int * page_idle ) {
+    if (get_global_id(0) != 0) {
+        return;
+    }
+    int page = page_info[2];
+    if (releasing(page_info)) {
+        if (page_info[3]) {
+            page_idle[page] = PAGE_PINNED;
+        }
+        else {
+            int slot = page_table[page];
+            int last = page_info[0] - 1;
+            int moved = page_list[last];
+            page_table[moved] = slot;
+            page_list[slot] = moved;
+            page_table[page] = -1;
+            page_info[0] = last;
+            page_idle[page] = 0;
+        }
+    }
+    page_info[2] = -1;
+    page_info[3] = 0;
+}
+
+// Atomic grid build, only launched with the unpacked layout (!GRID_PACKED)
+__kernel void update_grids( __global Particle * particles,
+                            __global int * grid,
+                            int grid_stride,
+                            __global int * pages,
+                            __global int * active,
+                            int parity,
+                            int2 GRID_SIZE_ARG,
+                            __constant int * footprint,
+                            __constant float * weights,
+                            __global int * baked ) {
+    int id = activeSlot(active, parity, get_global_id(0));
+
+    if (id >= 0) {
+
+        Particle P = particles[id];
+        if (P.id < 0 || baked[id] == BAKE_DONE) {
+            return;
+        }
+        int xc = (int)floor(P.position.x);
+        int yc = (int)floor(P.position.y);
+        float fx = P.position.x - (float)xc, fy = P.position.y - (float)yc;
+        int cls = footClass(P.radius);
+        int r = footReach(cls);
+        int variant = footVariant(fx, fy);
+        float invR2 = 1.f / (P.radius * P.radius);
+
+        for (int j=-r; j<=r; j++) {
+            int y = yc + j;
+            if (y < 0 || y >= grid_size.y) {
+                continue;
+            }
+            int2 span = footSpan(footprint, cls, variant, j);
+            float dy = (float)j + 0.5f - fy;
+            for (int i=max(span.x, -xc); i<=min(span.y, grid_size.x - 1 - xc); i++) {
+                int x = xc + i;
+                float dx = (float)i + 0.5f - fx;
+                float q = (dx*dx + dy*dy) * invR2;
+                int grid_index = cellIndex(pages, grid_size, x, y);
+                if (q < 1.f && grid_index >= 0) {
+                    float t = footWeight(weights, WEIGHT_SPLAT, q);
+                    atomic_add(&GRID(GRID_MASS, grid_index), TO_FIXED(P.mass * t));
+                    atomic_add(&GRID(GRID_HEAT, grid_index), TO_FIXED(P.heat * t));
+                    atomic_add(&GRID(GRID_VEL, grid_index), VEL_FIXED(P.velocity.x * t));
+                    atomic_add(&GRID(GRID_VEL + 1, grid_index), VEL_FIXED(P.velocity.y * t));
+                    // the lanes are summed packed, see the layout above
+                    uint2 types = packTypes((int4)(ROCK_FIXED(P.types.x * t), TYPE_FIXED(P.types.y * t),
+                                                   TYPE_FIXED(P.types.z * t), TYPE_FIXED(P.types.w * t)));
+                    atomic_add(&GRID(GRID_TYPES, grid_index), (int)types.x);
+                    atomic_add(&GRID(GRID_TYPES + 1, grid_index), (int)types.y);
+                    atomic_max(&GRID(GRID_MAXID, grid_index), P.id);
                 }
             }
         }
@@ -93,14 +763,228 @@ __kernel void update_grids( __global Particle * particles,
    
 }
 
-bool collisionDirRock ( __global GridCell * grid, int2 grid_size, float2 pos, float radius, int2 dir ) {
+// Sort based grid build: particles are binned by BIN_SIZE x BIN_SIZE cell tiles with a counting sort,
+// copied into bin order, then every grid cell gathers from the bins around it without atomics.
+// The particle buffer itself can't be put in bin order: a particle's slot is its id, which baked[], the
+// free list, GRID_MAXID and the emitters all refer to. The sorted copy is what the rest of the frame
+// reads instead (gather_grids, update_particles_sorted, update_particles_tiled), so neighbouring work
+// items read neighbouring particles and grid cells; only each particle's result goes back to its slot.
+
+#define BIN_BITS 4
+#define BIN_SIZE (1 << BIN_BITS)
+#define SCAN_GROUP 256
+
+int binIndex ( float2 pos, int2 GRID_SIZE_ARG ) {
+    int bins_x = (grid_size.x + BIN_SIZE - 1) >> BIN_BITS;
+    int bx = clamp((int)floor(pos.x), 0, grid_size.x - 1) >> BIN_BITS;
+    int by = clamp((int)floor(pos.y), 0, grid_size.y - 1) >> BIN_BITS;
+    return by * bins_x + bx;
+}
+
+__kernel void clear_bins( __global int * bin_count,
+                          int num_bins,
+                          __global int * sort_info ) {
+    int id = get_global_id(0);
+
+    if (id < num_bins) {
+        bin_count[id] = 0;
+    }
+    if (id == 0) {
+        sort_info[0] = 0;
+    }
+}
+
+__kernel void count_bins( __global Particle * particles,
+                          __global int * active,
+                          int parity,
+                          int2 GRID_SIZE_ARG,
+                          __global int * bin_count,
+                          __global int * bin_rank,
+                          __global int * sort_info ) {
+    int id = activeSlot(active, parity, get_global_id(0));
+
+    if (id >= 0) {
+        Particle P = particles[id];
+        if (P.id < 0) {
+            bin_rank[id] = -1;
+            return;
+        }
+        bin_rank[id] = atomic_inc(bin_count + binIndex(P.position, grid_size));
+        atomic_max(sort_info, (int)ceil(P.radius + 1.));
+    }
+}
+
+__kernel void scan_bins( __global int * bin_count,
+                         __global int * bin_start,
+                         int num_bins ) {
+    __local int partial[SCAN_GROUP];
+
+    int lid = get_local_id(0);
+    int chunk = (num_bins + SCAN_GROUP - 1) / SCAN_GROUP;
+    int i0 = min(lid * chunk, num_bins);
+    int i1 = min(i0 + chunk, num_bins);
+
+    int sum = 0;
+    for (int i=i0; i<i1; i++) {
+        sum += bin_count[i];
+    }
+    partial[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid == 0) {
+        int total = 0;
+        for (int i=0; i<SCAN_GROUP; i++) {
+            int c = partial[i];
+            partial[i] = total;
+            total += c;
+        }
+        bin_start[num_bins] = total;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int offset = partial[lid];
+    for (int i=i0; i<i1; i++) {
+        bin_start[i] = offset;
+        offset += bin_count[i];
+    }
+}
+
+__kernel void scatter_bins( __global Particle * particles,
+                            __global int * active,
+                            int parity,
+                            int2 GRID_SIZE_ARG,
+                            __global int * bin_start,
+                            __global int * bin_rank,
+                            __global Particle * sorted ) {
+    int id = activeSlot(active, parity, get_global_id(0));
+
+    if (id >= 0) {
+        int rank = bin_rank[id];
+        if (rank < 0) {
+            return;
+        }
+        Particle P = particles[id];
+        sorted[bin_start[binIndex(P.position, grid_size)] + rank] = P;
+    }
+}
+
+__kernel void gather_grids( __global Particle * sorted,
+                            __global int * bin_start,
+                            __global int * sort_info,
+                            __global int * grid,
+                            int grid_stride,
+                            __global int * page_list,
+                            __global int * page_info,
+                            int2 GRID_SIZE_ARG,
+                            __constant float * weights,
+                            __global int * baked ) {
+    int id = get_global_id(0);
+    int n = residentCells(page_info);
+
+    if (id < n) {
+
+        int page = page_list[id >> (PAGE_BITS * 2)];
+        int x = ((page % pagesX(grid_size)) << PAGE_BITS) + (id & (PAGE_SIZE - 1));
+        int y = ((page / pagesX(grid_size)) << PAGE_BITS) + ((id >> PAGE_BITS) & (PAGE_SIZE - 1));
+        int reach = sort_info[0];
+        int bins_x = (grid_size.x + BIN_SIZE - 1) >> BIN_BITS;
+        int bx0 = clamp(x - reach, 0, grid_size.x - 1) >> BIN_BITS;
+        int bx1 = clamp(x + reach, 0, grid_size.x - 1) >> BIN_BITS;
+        int by0 = clamp(y - reach, 0, grid_size.y - 1) >> BIN_BITS;
+        int by1 = clamp(y + reach, 0, grid_size.y - 1) >> BIN_BITS;
+
+        int mass = 0, heat = 0, maxID = -1;
+        int2 vel = (int2)(0);
+        int4 types = (int4)(0);
+
+        for (int by=by0; by<=by1; by++) {
+            int i0 = bin_start[by * bins_x + bx0];
+            int i1 = bin_start[by * bins_x + bx1 + 1];
+            for (int i=i0; i<i1; i++) {
+                Particle P = sorted[i];
+                if (baked[P.id] == BAKE_DONE) {
+                    continue;
+                }
+                float dx = ((float)(x) + 0.5f) - P.position.x, dy = ((float)(y) + 0.5f) - P.position.y;
+                float q = (dx*dx + dy*dy) / (P.radius * P.radius);
+                if (q < 1.f) {
+                    float t = footWeight(weights, WEIGHT_SPLAT, q);
+                    mass += TO_FIXED(P.mass * t);
+                    heat += TO_FIXED(P.heat * t);
+                    vel += (int2)(VEL_FIXED(P.velocity.x * t), VEL_FIXED(P.velocity.y * t));
+                    types += (int4)(ROCK_FIXED(P.types.x * t), TYPE_FIXED(P.types.y * t), TYPE_FIXED(P.types.z * t), TYPE_FIXED(P.types.w * t));
+                    maxID = max(maxID, P.id);
+                }
+            }
+        }
+
+        uint2 packed = packTypes(types);
+        GRID(GRID_MASS, id) = mass;
+        GRID(GRID_HEAT, id) = heat;
+        writeVelocity(grid, grid_stride, id, vel);
+        GRID(GRID_MAXID, id) = maxID;
+        GRID(GRID_TRACE, id) = 0;
+        GRID(GRID_TYPES, id) = (int)packed.x;
+        if (TYPE_WORDS > 1) {
+            GRID(GRID_TYPES + 1, id) = (int)packed.y;
+        }
+    }
+}
+
+// Rock occupancy: one bit per cell, set where hasRock() holds, rebuilt from the grid every frame by
+// build_rock_mask so the single work-item player and trace kernels test for rock with one word load
+// per cell instead of reading the GRID_TYPES and ROCK_TYPE planes. A word is one page row.
+
+#if PAGE_BITS != 5
+#error "build_rock_mask packs one page row per 32-bit word"
+#endif
+
+int maskWords ( int2 GRID_SIZE_ARG ) {
+    return (grid_size.x + 31) >> 5;
+}
+
+bool rockAt ( __global uint * rock_mask, int2 GRID_SIZE_ARG, int x, int y ) {
+    if (x < 0 || y < 0 || x >= grid_size.x || y >= grid_size.y) {
+        return false;
+    }
+    return ((rock_mask[y * maskWords(grid_size) + (x >> 5)] >> (x & 31)) & 1) != 0;
+}
+
+__kernel void build_rock_mask( __global int * grid,
+                               __global int * rock_layer,
+                               int grid_stride,
+                               __global int * pages,
+                               int2 GRID_SIZE_ARG,
+                               __global uint * rock_mask ) {
+    int id = get_global_id(0);
+    int words = maskWords(grid_size);
+
+    if (id < words * grid_size.y) {
+        int y = id / words;
+        int x0 = (id - y * words) << 5;
+        int base = cellIndex(pages, grid_size, x0, y);
+        uint bits = 0;
+        if (base >= 0) {
+            int n = min(32, grid_size.x - x0);
+            for (int i=0; i<n; i++) {
+                if (hasRock(grid, rock_layer, grid_stride, base + i)) {
+                    bits |= 1u << i;
+                }
+            }
+        }
+        rock_mask[id] = bits;
+    }
+}
+
+// Tests the same cells the old full-grid scan did: its falloff, 1 - (dx*dx+dy*dy / radius*radius),
+// is positive only for dx*dx + dy*dy < 1 (the radius cancels), so only the 3x3 block can hit
+bool collisionDirRock ( __global uint * rock_mask, int2 GRID_SIZE_ARG, float2 pos, int2 dir ) {
 
     int xc = (int)floor(pos.x);
     int yc = (int)floor(pos.y);
-    int r = (int)ceil(radius + 1.);
 
-    for (int x=xc - r; x<=(xc + r); x++) {
-        for (int y=yc - r; y<=(yc + r); y++) {
+    for (int x=xc - 1; x<=(xc + 1); x++) {
+        for (int y=yc - 1; y<=(yc + 1); y++) {
             if (dir.x < 0 && x >= xc) {
                 continue;
             }
@@ -113,16 +997,9 @@ bool collisionDirRock ( __global GridCell * grid, int2 grid_size, float2 pos, fl
             if (dir.y > 0 && y <= yc) {
                 continue;
             }
-            if (x >= 0 && y >= 0 && x < grid_size.x && y < grid_size.y) {
-                float dx = ((float)(x) + 0.5) - pos.x, dy = ((float)(y) + 0.5) - pos.y;
-                float t = 1. - (dx*dx+dy*dy / radius*radius);
-                if (t > 0.) {
-                    int grid_index = y * grid_size.x + x;
-                    __global int * GC = (__global int*)(grid + grid_index);
-                    if (GC[4] > 0) {
-                        return true;
-                    }
-                }
+            float dx = ((float)(x) + 0.5) - pos.x, dy = ((float)(y) + 0.5) - pos.y;
+            if (dx*dx + dy*dy < 1. && rockAt(rock_mask, grid_size, x, y)) {
+                return true;
             }
         }
     }
@@ -131,7 +1008,7 @@ bool collisionDirRock ( __global GridCell * grid, int2 grid_size, float2 pos, fl
 
 }
 
-float getHeat ( __global GridCell * grid, int2 grid_size, float2 pos, float radius ) {
+float getHeat ( __global int * grid, int grid_stride, __global int * pages, int2 GRID_SIZE_ARG, float2 pos, float radius ) {
 
     int xc = (int)floor(pos.x);
     int yc = (int)floor(pos.y);
@@ -144,10 +1021,9 @@ float getHeat ( __global GridCell * grid, int2 grid_size, float2 pos, float radi
             if (x >= 0 && y >= 0 && x < grid_size.x && y < grid_size.y) {
                 float dx = ((float)(x) + 0.5) - pos.x, dy = ((float)(y) + 0.5) - pos.y;
                 float t = 1. - (dx*dx+dy*dy / radius*radius);
-                if (t > 0.) {
-                    int grid_index = y * grid_size.x + x;
-                    __global int * GC = (__global int*)(grid + grid_index);
-                    ret += TO_FLOAT(GC[1]);
+                int grid_index = cellIndex(pages, grid_size, x, y);
+                if (t > 0. && grid_index >= 0) {
+                    ret += TO_FLOAT(GRID(GRID_HEAT, grid_index));
                 }
             }
         }
@@ -157,19 +1033,27 @@ float getHeat ( __global GridCell * grid, int2 grid_size, float2 pos, float radi
 
 }
 
-__kernel void update_trace( __global GridCell * grid,
-                            int2 grid_size,
+__kernel void update_trace( __global int * grid,
+                            __global uint * rock_mask,
+                            int grid_stride,
+                            __global int * pages,
+                            __global int * page_list,
+                            __global int * page_info,
+                            int2 GRID_SIZE_ARG,
                             __global Trace * trace,
-                            int num_trace,
+                            int NUM_TRACE_ARG,
+                            __global int * page_touched,
                             float2 world_mouse,
                             float delta_time,
-                            float2 player0,
-                            float gravity ) {
+                            __global Player * player,
+                            float GRAVITY_ARG ) {
 
     int id = get_global_id(0);
 
-    if (id == 0) {
+    // the player as the previous update_player left it; the host's copy is a few frames old
+    if (id == 0 && player->moving == 0 && player->health > 0.) {
 
+        float2 player0 = player->pos;
         float traceR = 4.;
         float2 vel = (world_mouse - player0) * (float2)2.;
         float speed = length(vel);
@@ -189,26 +1073,26 @@ __kernel void update_trace( __global GridCell * grid,
                 player0 += vel * delta_time * dtf;
 
                 if (vel.y < 0.) {
-                    if (collisionDirRock(grid, grid_size, player0, traceR, (int2)(0, -1))) {
+                    if (collisionDirRock(rock_mask, grid_size, player0, (int2)(0, -1))) {
                         player0.y += traceR;
                         vel.y = -vel.y * 0.5;
                     }
                 }
                 else if (vel.y > 0.) {
-                    if (collisionDirRock(grid, grid_size, player0, traceR, (int2)(0, 1))) {
+                    if (collisionDirRock(rock_mask, grid_size, player0, (int2)(0, 1))) {
                         player0.y -= traceR;
                         vel.y = -vel.y * 0.5;
                         break;
                     }
                 }
                 if (vel.x < 0.) {
-                    if (collisionDirRock(grid, grid_size, player0, traceR, (int2)(-1, 0))) {
+                    if (collisionDirRock(rock_mask, grid_size, player0, (int2)(-1, 0))) {
                         player0.x += traceR;
                         vel.x = -vel.x * 0.5;
                     }
                 }
                 else if (vel.x > 0.) {
-                    if (collisionDirRock(grid, grid_size, player0, traceR, (int2)(1, 0))) {
+                    if (collisionDirRock(rock_mask, grid_size, player0, (int2)(1, 0))) {
                         player0.x -= traceR;
                         vel.x = -vel.x * 0.5;
                     }
@@ -228,9 +1112,21 @@ __kernel void update_trace( __global GridCell * grid,
                             float t = 1. - sqrt(dx*dx+dy*dy) / traceR;
                             if (t > 0.) {
                                 t = (float)pow((double)t, 0.5);
-                                int grid_index = y * grid_size.x + x;
-                                __global int * GC = (__global int*)(grid + grid_index);
-                                atomic_add(GC + 9, TO_FIXED(0.25));
+                                int grid_index = cellIndex(pages, grid_size, x, y);
+                                if (grid_index < 0) {
+                                    // update_trace runs as a single work-item, so it can map pages itself
+                                    int page = (y >> PAGE_BITS) * pagesX(grid_size) + (x >> PAGE_BITS);
+                                    int slot = page_info[0];
+                                    if (slot >= page_info[1]) {
+                                        continue;
+                                    }
+                                    page_info[0] = slot + 1;
+                                    pages[page] = slot;
+                                    page_list[slot] = page;
+                                    grid_index = cellIndex(pages, grid_size, x, y);
+                                }
+                                atomic_add(&GRID(GRID_TRACE, grid_index), TO_FIXED(0.25));
+                                page_touched[(y >> PAGE_BITS) * pagesX(grid_size) + (x >> PAGE_BITS)] |= 1;
                             }
                         }
                     }
@@ -242,18 +1138,42 @@ __kernel void update_trace( __global GridCell * grid,
 
 }
 
-__kernel void update_player( __global GridCell * grid,
-                             int2 grid_size,
+__kernel void update_player( __global int * grid,
+                             __global uint * rock_mask,
+                             int grid_stride,
+                             __global int * pages,
+                             int2 GRID_SIZE_ARG,
                              float delta_time,
-                             float gravity,
-                             __global Player * player ) {
+                             float GRAVITY_ARG,
+                             __global Player * player,
+                             float2 target,
+                             int launch,
+                             float heal,
+                             int simulate ) {
 
     int id = get_global_id(0);
     float traceR = 4.;
 
     if (id == 0) {
 
-        if (getHeat(grid, grid_size, player->pos, traceR) > 0.) {
+        // input is applied here rather than written from the host, whose copy is a frame or two old
+        player->health += (100. - player->health) * heal;
+        if (!simulate) {
+            return;
+        }
+
+        if (launch && player->moving == 0) {
+            float2 vel = aimVelocity(target, player->pos);
+            if (vel.x != 0.f || vel.y != 0.f) {
+                player->moving = 1;
+                player->vel = vel;
+            }
+        }
+        if (player->moving == 0) {
+            player->vel = (float2)(0.f, 0.f);
+        }
+
+        if (getHeat(grid, grid_stride, pages, grid_size, player->pos, traceR) > 0.) {
             player->health -= 10. * delta_time;
             if (player->health < 0.) {
                 player->health = 0.;
@@ -278,13 +1198,13 @@ __kernel void update_player( __global GridCell * grid,
             player0 += vel * dt;
 
             if (vel.y < 0.) {
-                if (collisionDirRock(grid, grid_size, player0, traceR, (int2)(0, -1))) {
+                if (collisionDirRock(rock_mask, grid_size, player0, (int2)(0, -1))) {
                     player0.y += traceR;
                     vel.y = -vel.y * 0.5;
                 }
             }
             else if (vel.y > 0.) {
-                if (collisionDirRock(grid, grid_size, player0, traceR, (int2)(0, 1))) {
+                if (collisionDirRock(rock_mask, grid_size, player0, (int2)(0, 1))) {
                     player0.y -= traceR;
                     vel.y = -vel.y * 0.5;
                     player->moving = 0;
@@ -292,13 +1212,13 @@ __kernel void update_player( __global GridCell * grid,
                 }
             }
             if (vel.x < 0.) {
-                if (collisionDirRock(grid, grid_size, player0, traceR, (int2)(-1, 0))) {
+                if (collisionDirRock(rock_mask, grid_size, player0, (int2)(-1, 0))) {
                     player0.x += traceR;
                     vel.x = -vel.x * 0.5;
                 }
             }
             else if (vel.x > 0.) {
-                if (collisionDirRock(grid, grid_size, player0, traceR, (int2)(1, 0))) {
+                if (collisionDirRock(rock_mask, grid_size, player0, (int2)(1, 0))) {
                     player0.x -= traceR;
                     vel.x = -vel.x * 0.5;
                 }
@@ -313,188 +1233,496 @@ __kernel void update_player( __global GridCell * grid,
 
 }
 
-__kernel void update_particles( __global Particle * particles,
-                                __global GridCell * grid,
-                                int num_particles,
-                                int2 grid_size,
-                                float delta_time,
-                                float gravity ) {
-    int id = get_global_id(0);
-
-    if (id < num_particles) {
+typedef struct _CellSample {
+    float mass;
+    float heat;
+    float2 velocity;
+    float4 types;
+    int maxID;
+} CellSample;
+
+CellSample readCell ( __global int * grid, __global int * rock_layer, int grid_stride, __global int * pages, int2 GRID_SIZE_ARG, int x, int y ) {
+    CellSample C;
+    int index = cellIndex(pages, grid_size, x, y);
+    if (index < 0) {
+        C.mass = C.heat = 0.;
+        C.velocity = (float2)(0.);
+        C.types = (float4)(0.);
+        C.maxID = -1;
+        return C;
+    }
+    int rock = ROCK(ROCK_TYPE, index);
+    C.mass = TO_FLOAT(GRID(GRID_MASS, index) + ROCK(ROCK_MASS, index));
+    C.heat = TO_FLOAT(GRID(GRID_HEAT, index));
+    C.velocity = readVelocity(grid, grid_stride, index);
+    C.types = readTypes(grid, grid_stride, index);
+    C.types.x += (float)rock / TYPE_SCALE;
+    C.maxID = GRID(GRID_MAXID, index);
+    if (rock > 0) {
+        C.maxID = max(C.maxID, ROCK(ROCK_MAXID, index));
+    }
+    return C;
+}
 
-        Particle P = particles[id];
-        if (P.id < 0) {
-            return;
-        }
+// Tiled particle update: one work-group per bin loads the bin's cells plus a TILE_HALO border
+// into local memory, in the grid's packed form minus the trace plane. Bins with only a few
+// particles skip the load and read the grid directly.
+
+#define TILE_HALO 6
+#define TILE_DIM (BIN_SIZE + TILE_HALO * 2)
+#define TILE_CELLS (TILE_DIM * TILE_DIM)
+#define TILE_MASS 0
+#define TILE_HEAT 1
+#define TILE_VEL 2
+#define TILE_MAXID 3
+#define TILE_TYPES 4
+#define TILE_PLANES (TILE_TYPES + TYPE_WORDS)
+#define TILE_GROUP 64
+#define TILE_MIN_PARTICLES 8
+
+CellSample readTileCell ( __local int * tile, int index ) {
+    CellSample C;
+    C.mass = TO_FLOAT(tile[TILE_MASS * TILE_CELLS + index]);
+    C.heat = TO_FLOAT(tile[TILE_HEAT * TILE_CELLS + index]);
+    C.velocity = unpackVelocity(tile[TILE_VEL * TILE_CELLS + index]);
+    C.types = unpackTypes((uint)tile[TILE_TYPES * TILE_CELLS + index], TYPE_WORDS > 1 ? (uint)tile[(TILE_TYPES + 1) * TILE_CELLS + index] : 0);
+    C.maxID = tile[TILE_MAXID * TILE_CELLS + index];
+    return C;
+}
 
-        if (P.types.z > 0.5) {
-            P.velocity.y -= 0.5 * gravity * delta_time;
-        }
-        else {
-            P.velocity.y += gravity * delta_time;
+// One simulation step of a particle against the grid. Cells inside the tile are read from local
+// memory when use_tile is set, everything else comes from the grid.
+Particle stepParticle ( Particle P,
+                        __global int * grid,
+                        int grid_stride,
+                        __global int * pages,
+                        int2 GRID_SIZE_ARG,
+                        float delta_time,
+                        float GRAVITY_ARG,
+                        __constant int * footprint,
+                        __constant float * weights,
+                        __local int * tile,
+                        int2 tile_origin,
+                        int use_tile,
+                        __global int * rock_layer,
+                        __global int * baked,
+                        __global int * free_list ) {
+
+    // a rock that is baked stays put for the step it asks to be unbaked in, so the static layer
+    // can take it back at the position it was baked at
+    int slot = P.id;
+    int bake = baked[slot];
+
+    if (P.types.z > 0.5) {
+        P.velocity.y -= 0.5 * gravity * delta_time;
+    }
+    else {
+        P.velocity.y += gravity * delta_time;
+    }
+    P.velocity.x -= P.velocity.x * P.radius / P.mass * delta_time;
+    P.velocity.y -= P.velocity.y * P.radius / P.mass * delta_time;
+
+    int xc = (int)floor(P.position.x);
+    int yc = (int)floor(P.position.y);
+    int cls = footClass(P.radius);
+    int r = footReach(cls);
+    float invR2 = 1.f / (P.radius * P.radius);
+
+    float wPressX = 0.;
+    float wPressY = 0.;
+    float totalHeat = 0.;
+    float stick = 0.;
+    float totalT = 0.;
+
+    float myHeat = P.heat * sqrt(P.velocity.x * P.velocity.x + P.velocity.y * P.velocity.y) * P.mass / 10.f;
+
+    for (int j=-r; j<=r; j++) {
+        int y = yc + j;
+        if (y < 0 || y >= grid_size.y) {
+            continue;
         }
-        P.velocity.x -= P.velocity.x * P.radius / P.mass * delta_time;
-        P.velocity.y -= P.velocity.y * P.radius / P.mass * delta_time;
-
-        int xc = (int)floor(P.position.x);
-        int yc = (int)floor(P.position.y);
-        int r = (int)ceil(P.radius + 0.5);
-
-        float wPressX = 0.;
-        float wPressY = 0.;
-        float totalHeat = 0.;
-        float stick = 0.;
-        float totalT = 0.;
-
-        float myHeat = P.heat * sqrt(P.velocity.x * P.velocity.x + P.velocity.y * P.velocity.y) * P.mass / 10.f;
-
-        for (int x=xc - r; x<=(xc + r); x++) {
-            for (int y=yc - r; y<=(yc + r); y++) {
-                if (x >= 0 && y >= 0 && x < grid_size.x && y < grid_size.y) {
-                    float dx = (float)(x) - floor(P.position.x), dy = (float)(y) - floor(P.position.y);
-                    float t = 1. - sqrt(dx*dx+dy*dy) / P.radius;
-                    if (t > 0. && t < 1.) {
-                        int grid_index = y * grid_size.x + x;
-                        __global int * GC = (__global int*)(grid + grid_index);
-                        float mass = TO_FLOAT(GC[0]) * t;
-                        float heat = TO_FLOAT(GC[1]) * t;
-                        float2 velocity = (float2)(TO_FLOAT(GC[2]) * t, TO_FLOAT(GC[3]) * t);
-                        float4 types = (float4)(TO_FLOAT(GC[4]) * t, TO_FLOAT(GC[5]) * t, TO_FLOAT(GC[6]) * t, TO_FLOAT(GC[7]) * t);
-                        int maxID = GC[8];
-
-                        totalHeat += heat * sqrt(velocity.x * velocity.x + velocity.y * velocity.y) * mass / 10.f;
-
-                        totalT += t;
-
-                        if (types.x > 0.01) {
-                            mass *= 100.;
-                            stick += types.x * 100.;
-                        }
-                        if (types.y > 0.01) {
-                            stick += types.y * 0.025;
-                        }
-                        if (types.z > 0.01) {
-                            stick += types.y * 0.01;
-                        }
-
-                        if (fabs(dx - 0.f) < 0.0001f) {
-                            int r1 = (x + maxID) % 13;
-                            dx += (r1 / 12.) * 0.8 - 0.4;
-                        }
+        int2 span = footSpan(footprint, cls, FOOT_CENTRED, j);
+        for (int i=max(span.x, -xc); i<=min(span.y, grid_size.x - 1 - xc); i++) {
+            int x = xc + i;
+            float dx = (float)i, dy = (float)j;
+            float q = (dx*dx + dy*dy) * invR2;
+            if (q > 0.f && q < 1.f) {
+                float t = footWeight(weights, WEIGHT_GATHER, q);
+                int2 tc = (int2)(x, y) - tile_origin;
+                CellSample C = (use_tile && tc.x >= 0 && tc.y >= 0 && tc.x < TILE_DIM && tc.y < TILE_DIM) ?
+                    readTileCell(tile, tc.y * TILE_DIM + tc.x) : readCell(grid, rock_layer, grid_stride, pages, grid_size, x, y);
+                float mass = C.mass * t;
+                float heat = C.heat * t;
+                float2 velocity = C.velocity * (float2)(t);
+                float4 types = C.types * (float4)(t);
+                int maxID = C.maxID;
+
+                totalHeat += heat * sqrt(velocity.x * velocity.x + velocity.y * velocity.y) * mass / 10.f;
+
+                totalT += t;
+
+                if (types.x > 0.01) {
+                    mass *= 100.;
+                    stick += types.x * 100.;
+                }
+                if (types.y > 0.01) {
+                    stick += types.y * 0.025;
+                }
+                if (types.z > 0.01) {
+                    stick += types.y * 0.01;
+                }
 
-                        if (fabs(dy - 0.f) < 0.0001f) {
-                            int r1 = (y + maxID) % 13;
-                            dy += (r1 / 12.) * 0.8 - 0.4;
-                        }
+                if (fabs(dx - 0.f) < 0.0001f) {
+                    int r1 = (x + maxID) % 13;
+                    dx += (r1 / 12.) * 0.8 - 0.4;
+                }
 
-                        wPressX += -dx * mass;
-                        wPressY += -dy * mass;
-                    }
+                if (fabs(dy - 0.f) < 0.0001f) {
+                    int r1 = (y + maxID) % 13;
+                    dy += (r1 / 12.) * 0.8 - 0.4;
                 }
+
+                wPressX += -dx * mass;
+                wPressY += -dy * mass;
             }
         }
+    }
 
-        float avgHeat = totalHeat / totalT;
+    float avgHeat = totalHeat / totalT;
 
-        P.heat += (avgHeat * 0.1 - myHeat) * delta_time * 0.1;
-        if (P.heat > 11.) {
-            P.heat = 11.;
-        }
-        if (P.types.x > 0.5) {
-            P.heat -= 5. * delta_time * max(P.heat, 1.f);
-        }
-        else {
-            P.heat -= .5 * delta_time * max(P.heat, 1.f);
+    P.heat += (avgHeat * 0.1 - myHeat) * delta_time * 0.1;
+    if (P.heat > 11.) {
+        P.heat = 11.;
+    }
+    if (P.types.x > 0.5) {
+        P.heat -= 5. * delta_time * max(P.heat, 1.f);
+    }
+    else {
+        P.heat -= .5 * delta_time * max(P.heat, 1.f);
+    }
+    if (P.types.z > 0.5) {
+        P.radius -= P.radius * delta_time;
+        if (P.radius < 0.01f) {
+            P.id = -1;
         }
-        if (P.types.z > 0.5) {
-            P.radius -= P.radius * delta_time;
-            if (P.radius < 0.01f) {
+    }
+    if (P.types.y > 1.5) {
+        if (P.types.y > 2.5) {
+            P.radius -= P.radius * delta_time * 0.01;
+            if (P.radius < 1.5f) {
                 P.id = -1;
             }
         }
-        if (P.types.y > 1.5) {
-            if (P.types.y > 2.5) {
-                P.radius -= P.radius * delta_time * 0.01;
-                if (P.radius < 1.5f) {
-                    P.id = -1;
-                }
-            }
-            else {
-                P.radius -= P.radius * delta_time * 0.2;
-                if (P.radius < 1.5f) {
-                    P.id = -1;
-                }
-            }
-        }
-        if (P.heat <= 0.f) {
-            P.heat = 0.;
-            if (P.types.z > 0.5) {
+        else {
+            P.radius -= P.radius * delta_time * 0.2;
+            if (P.radius < 1.5f) {
                 P.id = -1;
             }
         }
-        if (P.types.x > 0.5 && P.heat > 10.) {
-            P.types = (float4)(0., 0., 1., 0.);
+    }
+    if (P.heat <= 0.f) {
+        P.heat = 0.;
+        if (P.types.z > 0.5) {
+            P.id = -1;
         }
-        if (P.types.y > 0.5 && P.heat > 0.1) {
-            P.heat = 1.;
-            P.radius *= 1.5;
-            P.mass *= 10.;
-            P.types = (float4)(0., 0., 1., 0.);
+    }
+    if (P.types.x > 0.5 && P.heat > 10. && bake != BAKE_DONE) {
+        P.types = (float4)(0., 0., 1., 0.);
+    }
+    if (P.types.y > 0.5 && P.heat > 0.1) {
+        P.heat = 1.;
+        P.radius *= 1.5;
+        P.mass *= 10.;
+        P.types = (float4)(0., 0., 1., 0.);
+    }
+
+    wPressX /= P.mass;
+    wPressY /= P.mass;
+
+    P.velocity.x += wPressX * delta_time;
+    P.velocity.y += wPressY * delta_time;
+
+    if (totalT) {
+        stick /= totalT;
+        if (stick > 1.) {
+            stick = 1.;
         }
 
-        wPressX /= P.mass;
-        wPressY /= P.mass;
+        P.velocity.x -= stick / 10. * P.velocity.x;
+        P.velocity.y -= stick / 10. * P.velocity.y;
+    }
 
-        P.velocity.x += wPressX * delta_time;
-        P.velocity.y += wPressY * delta_time;
+    if (P.types.x > 0.5 && (P.heat < 1. || bake == BAKE_DONE)) {
+        P.velocity = (float2)(0., 0.);
+    }
 
-        if (totalT) {
-            stick /= totalT;
-            if (stick > 1.) {
-                stick = 1.;
-            }
+    P.position.x += P.velocity.x * delta_time;
+    P.position.y += P.velocity.y * delta_time;
 
-            P.velocity.x -= stick / 10. * P.velocity.x;
-            P.velocity.y -= stick / 10. * P.velocity.y;
-        }
+    if (P.position.y >= (float)grid_size.y) {
+        P.id = -1;
+    }
 
-        if (P.types.x > 0.5 && P.heat < 1.) {
-            P.velocity = (float2)(0., 0.);
-        }
+    if (P.id < 0) {
+        // a dead rock may still have a bake request in flight; drop it before the slot is reused
+        baked[slot] = BAKE_NONE;
+        freeSlot(free_list, slot);
+    }
+    else if (bake == BAKE_DONE && P.heat >= 1.) {
+        baked[slot] = UNBAKE_PENDING;
+    }
+    else if (bake == BAKE_NONE && P.id >= 0 && P.types.x > 0.5 && P.heat <= 0.) {
+        baked[slot] = BAKE_PENDING;
+    }
 
-        P.position.x += P.velocity.x * delta_time;
-        P.position.y += P.velocity.y * delta_time;
+    return P;
 
-        if (P.position.y >= (float)grid_size.y) {
-            P.id = -1;
+}
+
+__kernel void update_particles( __global Particle * particles,
+                                __global int * grid,
+                                int grid_stride,
+                                __global int * pages,
+                                __global int * active,
+                                int parity,
+                                int2 GRID_SIZE_ARG,
+                                float delta_time,
+                                float GRAVITY_ARG,
+                                __global int * stale_grid,
+                                __global int * page_info,
+                                __constant int * footprint,
+                                __constant float * weights,
+                                __global int * rock_layer,
+                                __global int * baked,
+                                __global int * free_list ) {
+    // The grids ping-pong between frames: last frame's grid is cleared here so the next
+    // update_grids can accumulate into it without a separate clear pass
+    int n = residentCells(page_info);
+    for (int i=get_global_id(0); i<n; i+=get_global_size(0)) {
+        clearCell(stale_grid, grid_stride, i);
+    }
+
+    int id = activeSlot(active, parity, get_global_id(0));
+
+    if (id >= 0) {
+
+        Particle P = particles[id];
+        if (P.id < 0) {
+            return;
         }
 
-        particles[id] = P;
+        particles[id] = stepParticle(P, grid, grid_stride, pages, grid_size, delta_time, gravity, footprint, weights,
+                                     (__local int *)0, (int2)(0), 0, rock_layer, baked, free_list);
 
     }                                    
 }
 
+// update_particles for the sorted grid build: walks the sorted copy in bin order and writes each result
+// back to the particle's slot. There is no stale grid to clear, gather_grids writes every cell.
+__kernel void update_particles_sorted( __global Particle * particles,
+                                       __global Particle * sorted,
+                                       __global int * bin_start,
+                                       int num_bins,
+                                       __global int * grid,
+                                       int grid_stride,
+                                       __global int * pages,
+                                       int2 GRID_SIZE_ARG,
+                                       float delta_time,
+                                       float GRAVITY_ARG,
+                                       __constant int * footprint,
+                                       __constant float * weights,
+                                       __global int * rock_layer,
+                                       __global int * baked,
+                                       __global int * free_list ) {
+    int i = get_global_id(0);
+
+    if (i < bin_start[num_bins]) {
+        Particle P = sorted[i];
+        particles[P.id] = stepParticle(P, grid, grid_stride, pages, grid_size, delta_time, gravity, footprint, weights,
+                                       (__local int *)0, (int2)(0), 0, rock_layer, baked, free_list);
+    }
+}
+
+// Launched as one TILE_GROUP work-group per bin over the sorted copy from the sorted grid build
+__kernel void update_particles_tiled( __global Particle * particles,
+                                      __global Particle * sorted,
+                                      __global int * bin_start,
+                                      __global int * grid,
+                                      int grid_stride,
+                                      __global int * pages,
+                                      int2 GRID_SIZE_ARG,
+                                      float delta_time,
+                                      float GRAVITY_ARG,
+                                      __constant int * footprint,
+                                      __constant float * weights,
+                                      __global int * rock_layer,
+                                      __global int * baked,
+                                      __global int * free_list ) {
+    __local int tile[TILE_PLANES * TILE_CELLS];
+
+    int bin = get_group_id(0);
+    int lid = get_local_id(0);
+    int bins_x = (grid_size.x + BIN_SIZE - 1) >> BIN_BITS;
+    int bins_y = (grid_size.y + BIN_SIZE - 1) >> BIN_BITS;
+
+    if (bin >= bins_x * bins_y) {
+        return;
+    }
+
+    int i0 = bin_start[bin], i1 = bin_start[bin + 1];
+    int2 origin = (int2)((bin % bins_x) * BIN_SIZE - TILE_HALO, (bin / bins_x) * BIN_SIZE - TILE_HALO);
+    int use_tile = (i1 - i0) >= TILE_MIN_PARTICLES;
+
+    if (use_tile) {
+        for (int c=lid; c<TILE_CELLS; c+=TILE_GROUP) {
+            int x = origin.x + c % TILE_DIM, y = origin.y + c / TILE_DIM;
+            int index = (x >= 0 && y >= 0 && x < grid_size.x && y < grid_size.y) ? cellIndex(pages, grid_size, x, y) : -1;
+            int rock = index >= 0 ? ROCK(ROCK_TYPE, index) : 0;
+            tile[TILE_MASS * TILE_CELLS + c] = index >= 0 ? GRID(GRID_MASS, index) + ROCK(ROCK_MASS, index) : 0;
+            tile[TILE_HEAT * TILE_CELLS + c] = index >= 0 ? GRID(GRID_HEAT, index) : 0;
+            tile[TILE_VEL * TILE_CELLS + c] = index >= 0 ? readVelocityWord(grid, grid_stride, index) : 0;
+            tile[TILE_MAXID * TILE_CELLS + c] = index < 0 ? -1 : rock > 0 ? max(GRID(GRID_MAXID, index), ROCK(ROCK_MAXID, index)) : GRID(GRID_MAXID, index);
+            for (int w=0; w<TYPE_WORDS; w++) {
+                tile[(TILE_TYPES + w) * TILE_CELLS + c] = index >= 0 ? GRID(GRID_TYPES + w, index) : 0;
+            }
+            // the static rock goes into lane 0 (rock) of the first types word
+            int lane = tile[TILE_TYPES * TILE_CELLS + c] & TYPE_MAX;
+            tile[TILE_TYPES * TILE_CELLS + c] += min(lane + rock, TYPE_MAX) - lane;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (int i=i0 + lid; i<i1; i+=TILE_GROUP) {
+        Particle P = sorted[i];
+        particles[P.id] = stepParticle(P, grid, grid_stride, pages, grid_size, delta_time, gravity, footprint, weights,
+                                       tile, origin, use_tile, rock_layer, baked, free_list);
+    }
+}
+
 #define CAMX(_X) (((float)(_X) - (float)camera.x) / camera.z + ((float)render_size.x) * 0.5)
 #define CAMY(_X) (((float)(_X) - (float)camera.y) / camera.z + ((float)render_size.y) * 0.5)
 #define ICAMX(_X) (((float)(_X) - 0.5 * (float)render_size.x) * camera.z + ((float)camera.x))
 #define ICAMY(_X) (((float)(_X) - 0.5 * (float)render_size.y) * camera.z + ((float)camera.y))
 
+// World colour: the rock palette, oil darkening, heat glow and trace of each cell, shaded by shade_world
+// into an RGBA8 image the size of the grid that render_main samples. Only pages in page_touched are
+// reshaded, which holds two frames of history of mark_pages and update_trace touching a page (shifted
+// by alloc_pages), so a page is redrawn once more after its last particle leaves. The host asks for a
+// full pass after a level reset or a change of render size.
+
+#define WORLD_FILTER CLK_FILTER_NEAREST // CLK_FILTER_LINEAR blends neighbouring cells when zoomed in
+
+float4 cellColor ( __global int * grid, __global int * rock_layer, int grid_stride, int grid_index, int y, int2 render_size ) {
+    float yt = 1. - ((float)y / (float)render_size.y) * 0.5;
+    float4 clr = (float4)(yt + (1. - yt) * 0.5, yt + (1. - yt) * 0.5, yt + (1. - yt) * 0.1, 1.) * (float4)(0.4);
+
+    float heat = 0., rocks = 0., oil = 0., trace = 0.;
+    int maxID = -1;
+    if (grid_index >= 0) {
+        float4 types = readTypes(grid, grid_stride, grid_index);
+        heat = TO_FLOAT(GRID(GRID_HEAT, grid_index));
+        int rock = ROCK(ROCK_TYPE, grid_index);
+        rocks = types.x + (float)rock / TYPE_SCALE;
+        oil = types.y;
+        trace = TO_FLOAT(GRID(GRID_TRACE, grid_index));
+        maxID = GRID(GRID_MAXID, grid_index);
+        if (rock > 0) {
+            maxID = max(maxID, ROCK(ROCK_MAXID, grid_index));
+        }
+    }
+
+    if (rocks > 0.0) {
+        int rand1 = (maxID * 17) % 3;
+        if (rand1 == 0) {
+            clr.x = 0.366;
+            clr.y = 0.289;
+            clr.z = 0.289;
+        }
+        else if (rand1 == 1) {
+            clr.x = 0.511;
+            clr.y = 0.429;
+            clr.z = 0.428;
+        }
+        else if (rand1 == 2) {
+            clr.x = 0.444;
+            clr.y = 0.364;
+            clr.z = 0.256;
+        }
+        clr.xyz *= (float3)(min(rocks / 2.5f, 1.f));
+    }
+
+    if (oil > 0.5) {
+        float3 t = clamp((float3)(oil-2.5f) / 2.5f, (float3)0., (float3)1.);
+        clr.xyz = ((float3)1. - t) * clr.xyz;
+    }
+
+    float heatT = clamp(heat / 10.f, 0.f, 1.f);
+    clr.x += min(heatT * 4., 1.);
+    clr.y += min(heatT * 2., 1.);
+    clr.z += min(heatT * 1., 1.);
+
+    clr.g += trace;
+
+    // channels only grow from here in render_main, so clamping before the health tint changes nothing
+    return clamp(clr, (float4)(0.), (float4)(1.));
+}
+
+__kernel void shade_world( __write_only image2d_t world_color,
+                           int2 render_size,
+                           __global int * grid,
+                           __global int * rock_layer,
+                           int grid_stride,
+                           __global int * pages,
+                           __global int * page_list,
+                           __global int * page_info,
+                           __global int * page_touched,
+                           int2 GRID_SIZE_ARG,
+                           int full ) {
+    int id = get_global_id(0);
+    int x, y, grid_index;
+
+    if (full) {
+        if (id >= grid_size.x * grid_size.y) {
+            return;
+        }
+        y = id / grid_size.x;
+        x = id - y * grid_size.x;
+        grid_index = cellIndex(pages, grid_size, x, y);
+    }
+    else {
+        if (id >= residentCells(page_info)) {
+            return;
+        }
+        int page = page_list[id >> (PAGE_BITS * 2)];
+        if (page_touched[page] == 0) {
+            return;
+        }
+        x = ((page % pagesX(grid_size)) << PAGE_BITS) + (id & (PAGE_SIZE - 1));
+        y = ((page / pagesX(grid_size)) << PAGE_BITS) + ((id >> PAGE_BITS) & (PAGE_SIZE - 1));
+        if (x >= grid_size.x || y >= grid_size.y) {
+            return;
+        }
+        grid_index = id;
+    }
+
+    write_imagef(world_color, (int2)(x, y), cellColor(grid, rock_layer, grid_stride, grid_index, y, render_size));
+}
+
 __kernel void render_main( __write_only image2d_t out_color,
                              int2 render_size,
-                             __global GridCell * grid,
-                             int2 grid_size,
+                             __read_only image2d_t world_color,
+                             int2 GRID_SIZE_ARG,
                              float3 camera,
                              float health,
                              float deathTimer,
                              float winTimer ) {
-    int id = get_global_id(0);
-    int n = render_size.x * render_size.y;
+    const sampler_t world_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | WORLD_FILTER;
 
-    if (id < n) {
+    // launched 2D, one work item per pixel, so a work group covers a block of the screen
+    int sx = get_global_id(0);
+    int sy = get_global_id(1);
 
-        int sx = id % render_size.x;
-        int sy = (id - sx) / render_size.x;
+    if (sx < render_size.x && sy < render_size.y) {
 
         float cx = ICAMX(sx);
         float cy = ICAMY(sy);
@@ -502,53 +1730,16 @@ __kernel void render_main( __write_only image2d_t out_color,
         int x = (int)round(cx);
         int y = (int)round(cy);
 
-        float yt = 1. - ((float)y / (float)render_size.y) * 0.5;
-        float4 clr = (float4)(yt + (1. - yt) * 0.5, yt + (1. - yt) * 0.5, yt + (1. - yt) * 0.1, 1.) * (float4)(0.4);
+        float4 clr;
 
         if (x >= 0 && y >= 0 && x < grid_size.x && y < grid_size.y) {
-            int grid_index = y * grid_size.x + x;
-            __global GridCell * GC = grid + grid_index;
-            float heat = TO_FLOAT(GC->heat);
-            float rocks = TO_FLOAT(GC->types.x);
-            float oil = TO_FLOAT(GC->types.y);
-            float fire = TO_FLOAT(GC->types.z);
-            float water = TO_FLOAT(GC->types.w);
-            float trace = TO_FLOAT(GC->trace);
-
-            if (rocks > 0.0) {
-                int rand1 = (GC->maxID * 17) % 3;
-                if (rand1 == 0) {
-                    clr.x = 0.366;
-                    clr.y = 0.289;
-                    clr.z = 0.289;
-                }
-                else if (rand1 == 1) {
-                    clr.x = 0.511;
-                    clr.y = 0.429;
-                    clr.z = 0.428;
-                }
-                else if (rand1 == 2) {
-                    clr.x = 0.444;
-                    clr.y = 0.364;
-                    clr.z = 0.256;
-                }
-                clr.xyz *= (float3)(min(rocks / 2.5f, 1.f));
-            }
-
-            if (oil > 0.5) {
-                float3 t = clamp((float3)(oil-2.5f) / 2.5f, (float3)0., (float3)1.);
-                clr.xyz = ((float3)1. - t) * clr.xyz;
-            }
-
-            float heatT = clamp(heat / 10.f, 0.f, 1.f);
-            clr.x += min(heatT * 4., 1.);
-            clr.y += min(heatT * 2., 1.);
-            clr.z += min(heatT * 1., 1.);
-
-            clr.g += trace;
-
+            clr = read_imagef(world_color, world_sampler, (float2)(cx + 0.5f, cy + 0.5f));
             clr.x += min(pow(1.f - health / 100.f, 1.5f), 0.5f);
         }
+        else {
+            float yt = 1. - ((float)y / (float)render_size.y) * 0.5;
+            clr = (float4)(yt + (1. - yt) * 0.5, yt + (1. - yt) * 0.5, yt + (1. - yt) * 0.1, 1.) * (float4)(0.4);
+        }
 
         clr = clamp(clr, (float4)(0.), (float4)(1.));
 
@@ -567,4 +1758,46 @@ __kernel void render_main( __write_only image2d_t out_color,
         write_imagef(out_color, (int2)(sx, sy), clr);
 
     }
-}
\ No newline at end of file
+}
+// Edge-aware upscale of the render_main image to the window when rendering below native resolution:
+// the four bilinear taps are weighted down by their colour distance from the nearest one, so the
+// filter smooths within a region but doesn't blur across rock/particle edges
+#define UPSCALE_EDGE 24.f // higher keeps edges harder, 0 is plain bilinear
+
+__kernel void upscale_frame( __read_only image2d_t src,
+                             int2 src_size,
+                             __write_only image2d_t dst,
+                             int2 dst_size ) {
+    const sampler_t src_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+    int dx = get_global_id(0);
+    int dy = get_global_id(1);
+
+    if (dx < dst_size.x && dy < dst_size.y) {
+
+        float px = ((float)dx + 0.5f) * (float)src_size.x / (float)dst_size.x - 0.5f;
+        float py = ((float)dy + 0.5f) * (float)src_size.y / (float)dst_size.y - 0.5f;
+        float x0 = floor(px), y0 = floor(py);
+        float fx = px - x0, fy = py - y0;
+
+        float4 c00 = read_imagef(src, src_sampler, (int2)((int)x0, (int)y0));
+        float4 c10 = read_imagef(src, src_sampler, (int2)((int)x0 + 1, (int)y0));
+        float4 c01 = read_imagef(src, src_sampler, (int2)((int)x0, (int)y0 + 1));
+        float4 c11 = read_imagef(src, src_sampler, (int2)((int)x0 + 1, (int)y0 + 1));
+
+        float w00 = (1.f - fx) * (1.f - fy), w10 = fx * (1.f - fy), w01 = (1.f - fx) * fy, w11 = fx * fy;
+
+        float4 nearest = fx < 0.5f ? (fy < 0.5f ? c00 : c01) : (fy < 0.5f ? c10 : c11);
+        float4 d;
+        d = c00 - nearest; w00 *= native_recip(1.f + UPSCALE_EDGE * dot(d.xyz, d.xyz));
+        d = c10 - nearest; w10 *= native_recip(1.f + UPSCALE_EDGE * dot(d.xyz, d.xyz));
+        d = c01 - nearest; w01 *= native_recip(1.f + UPSCALE_EDGE * dot(d.xyz, d.xyz));
+        d = c11 - nearest; w11 *= native_recip(1.f + UPSCALE_EDGE * dot(d.xyz, d.xyz));
+
+        float4 clr = (c00 * w00 + c10 * w10 + c01 * w01 + c11 * w11) * native_recip(w00 + w10 + w01 + w11);
+        clr.w = 1.f;
+
+        write_imagef(dst, (int2)(dx, dy), clr);
+
+    }
+}
@@ -12,6 +12,8 @@
 
 #include "vec_math.h"
 #include "cl_wrapper.h"
+#include "frame_writer.h"
+#include "gl_upload.h"
 
 using std::cerr;
 using std::cout;
@@ -23,17 +25,6 @@ using namespace irrklang;
 
 
 // Mirror classes for transfering data to/from kernels
-class GridCell {
-public:
-    CLInt mass;
-    CLInt heat;
-    CLInt2 velocity; // 4
-    CLInt4 types; // 8 // x:rock, y:oil, z:fire/smoke, w:water/steam
-    CLInt maxID;
-    CLInt3 dummy;
-    GridCell() { }
-};
-
 class Particle {
 public:
     CLInt id;
@@ -81,12 +72,137 @@ public:
     }
 };
 
-CLInt NUM_PARTICLES = 512 * 512;
+#define EMIT_FIXED 0 // must match EMIT_FIXED etc. in kernels/main.cl
+#define EMIT_PLAYER 1
+#define EMIT_AIM 2
+
+class Emitter {
+public:
+    CLFloat2 position;
+    CLFloat2 velocity; // 4
+    CLFloat2 velocityRange;
+    CLFloat spread;
+    CLFloat scaleRange; // 8
+    CLFloat radius;
+    CLFloat mass;
+    CLFloat heat;
+    CLInt first; // 12
+    CLInt count;
+    CLInt burst;
+    CLInt follow;
+    CLInt dummy; // 16
+    CLFloat4 types; // 20
+    Emitter() {
+        position.x = position.y = 0.;
+        velocity.x = velocity.y = 0.;
+        velocityRange.x = velocityRange.y = 0.;
+        spread = scaleRange = 0.;
+        radius = mass = heat = 0.;
+        types.x = types.y = types.z = types.w = 0.;
+        first = 0;
+        count = burst = 1;
+        follow = EMIT_FIXED;
+        dummy = 0;
+    }
+};
+
+CLInt NUM_PARTICLES = 512 * 512; // upper limit, the pool itself grows on demand
 CLInt2 GRID_SIZE(2048, 2048);
 CLFloat GRAVITY = 64.;
 CLFloat3 CAMERA;
 CLInt NUM_TRACE = 64;
 
+// Grid build path: atomic scatter (update_grids) or counting sort + gather (gather_grids)
+bool SORTED_GRID_BUILD = false;
+// Particle update from local-memory tiles, one work-group per bin; needs the sorted grid build
+bool TILED_PARTICLES = false;
+#define TILE_GROUP 64 // must match TILE_GROUP in kernels/main.cl
+bool PROFILE_KERNELS = false;
+// Build the kernels with the grid size, gravity and trace length as constants
+bool SPECIALIZE_KERNELS = true;
+// Time every candidate work group shape at startup and save the fastest to TUNING_FILE
+bool AUTOTUNE = false;
+#define TUNING_FILE "autotune.cfg"
+#define AUTOTUNE_FRAMES 16
+// No window, GL or sound: render_main draws into plain images that are read back and, with a DUMP_TARGET,
+// written out by a FrameWriter; runs HEADLESS_FRAMES frames at a fixed step of 1 / HEADLESS_FPS
+bool HEADLESS = false;
+int HEADLESS_FRAMES = 600;
+int HEADLESS_FPS = 60;
+string DUMP_TARGET = "";
+// Fraction of the window's resolution render_main shades at; below 1 upscale_frame fills the window from
+// the smaller image. - and = step it live.
+CLFloat RENDER_SCALE = 1.;
+#define RENDER_SCALE_MIN 0.5f
+#define RENDER_SCALE_STEP 0.1f
+#define DUMP_QUEUE 8 // frames waiting for the writer before the simulation has to wait for it
+// Run on a CPU OpenCL device even when there is a GPU one
+bool USE_CPU = false;
+// Whether render_main writes the window's texture directly (cl_khr_gl_sharing); without it, and always when
+// HEADLESS, frames are read back through frameReadback and presented by frameUpload a frame later
+bool GL_INTEROP = true;
+#define BIN_SIZE 16 // must match BIN_SIZE in kernels/main.cl
+
+// Sparse grid: cells live in PAGE_SIZE x PAGE_SIZE pages allocated on demand from a growable pool
+#define PAGE_SIZE 32 // must match PAGE_SIZE in kernels/main.cl
+#define PAGE_CELLS (PAGE_SIZE * PAGE_SIZE)
+CLInt gridPageCapacity = 0;
+
+// Grid pools are one int plane per channel: mass, heat, maxID, trace, then velocity and types. The
+// sorted build packs velocity into one plane and types into TYPE_BITS lanes (-typebits 8 or 16); the
+// atomic build keeps two velocity planes and 16 bit type lanes so its sums have headroom. The layout
+// is passed to kernels/main.cl as defines (kernelDefines), which checks it against its GRID_* layout.
+CLInt TYPE_BITS = 16;
+#define GRID_MAXID 2
+
+CLInt gridTypeBits (bool sorted) {
+    return sorted ? TYPE_BITS : 16;
+}
+
+CLInt gridPlanes (bool sorted) {
+    return 4 + (sorted ? 1 : 2) + (gridTypeBits(sorted) == 8 ? 1 : 2);
+}
+
+// Static layer for baked cold rock, on the same page slots as the grid pools
+#define ROCK_MAXID 2
+#define ROCK_PLANES 3
+
+// Footprint span/weight tables for the splat and gather loops; layout documented in kernels/main.cl
+#define RADIUS_STEP 0.25 // must match kernels/main.cl
+#define FOOT_SUBCELLS 4
+#define FOOT_VARIANTS (FOOT_SUBCELLS * FOOT_SUBCELLS + 1)
+#define WEIGHT_LUT 512
+#define FOOTPRINT_MAX_INTS 12288 // keeps the table well inside 64kb of constant memory
+CLFloat footprintRadius = 0.;
+
+// Live particle list (see compact_particles). The live count is read back without blocking; launches
+// are sized from the last count seen plus every particle spawned since it was taken.
+#define COMPACT_GROUP 256
+#define CLEAR_MIN_ITEMS 65536 // update_particles also clears the stale grid, keep enough work-items for it
+CLInt activeParity = 1;
+CLInt liveLaunch = 0;
+CLInt liveKnown = 0;
+long long liveKnownSpawnedAt = 0;
+long long particlesSpawned = 0;
+CLInt liveReadback[2];
+long long liveSpawnedAt[2];
+bool livePending[2] = { false, false };
+
+// Particle pool: slots are handed out from a device free list (see free_slots in kernels/main.cl) and
+// the pool is doubled, up to NUM_PARTICLES, before a spawn could run the list dry
+#define PARTICLE_MIN_CAPACITY 65536
+CLInt particleCapacity = 0;
+
+// Level generation's particles, handed to the device in one upload by flushSpawns. Everything spawned
+// during play comes from the emitters instead.
+vector<Particle> spawns;
+
+// Per-level emitters, laid out back to back in emitterBfr; the aimed spray is always last so it can
+// be left out of the launch while the button is up
+vector<Emitter> emitters;
+CLInt emitTotal = 0;
+CLInt emitSeed = 0;
+
 #define RAND ((float)(rand() % 12347) / 12347.)
 
 ISoundEngine* soundEngine = NULL;
@@ -94,31 +210,103 @@ ISoundEngine* soundEngine = NULL;
 ////////////
 
 CLContext * clContext;
+CLProgramCache * programs;
+CLTuning * tuning;
 CLProgram * program;
-CLImageGL * outImage;
+CLInt2 currentRenderSize; // render_main's size this frame, see setRenderSize
+CLFrameGraph * graph;
+// Grow-only, in OUTPUT_BUCKET steps: each frame fills the top-left outputSize() of it and GL draws just
+// that part, so a resize within its capacity allocates nothing
+CLImageGL * outImage = NULL;
+CLImage * scaledImage = NULL; // render_main's output below native resolution
+CLFrameReadback * frameReadback = NULL;
+CLFrameReadback * retiredReadback = NULL; // replaced by a regrow, its last frame is presented before it goes
+GLPixelUpload * frameUpload = NULL;
+CLInt2 presentSize(0, 0); // the frame frameUpload last put in outImage
+FrameWriter * frameWriter = NULL;
+// RGBA8 colour of every grid cell, see shade_world in kernels/main.cl
+CLImage * worldImage;
+bool worldShadeFull = true;
 CLBuffer * particleBfr;
-CLBuffer * gridBfr;
+CLBuffer * gridBfr = NULL;
+CLBuffer * staleGridBfr = NULL;
+CLBuffer * rockLayerBfr = NULL;
+CLBuffer * rockMaskBfr;
+CLBuffer * bakedBfr;
 CLBuffer * traceBfr;
 CLBuffer * playerBfr;
+CLBuffer * binCountBfr;
+CLBuffer * binStartBfr;
+CLBuffer * binRankBfr;
+CLBuffer * sortedBfr;
+CLBuffer * sortInfoBfr;
+CLBuffer * pageTableBfr;
+CLBuffer * pageFlagsBfr;
+CLBuffer * pageListBfr;
+CLBuffer * pageInfoBfr;
+CLBuffer * pageTouchedBfr;
+CLBuffer * pageIdleBfr;
+CLBuffer * footprintBfr = NULL;
+CLBuffer * activeBfr;
+CLBuffer * freeBfr;
+CLBuffer * emitterBfr = NULL;
+CLBuffer * spawnBfr = NULL;
+cl::Event liveEvent[2];
+CLBuffer * weightBfr;
+CLKernelHandle<CLBuffer *, CLInt, CLBuffer *> * clearRockLayerKernel;
+CLKernelHandle<CLBuffer *, CLInt, CLInt> * freeSlotsKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLInt2, CLBuffer *> * buildRockMaskKernel;
+CLKernelHandle<CLBuffer *, CLInt, CLBuffer *, CLInt, CLBuffer *> * compactParticlesKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *> * spawnParticlesKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLInt, CLBuffer *, CLBuffer *, CLFloat2, CLInt> * emitParticlesKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLInt2, CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLBuffer *> * markPagesKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *> * allocPagesKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLInt> * checkPageReleaseKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLInt> * releasePageKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *> * finishPageReleaseKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *> * resetPagesKernel;
+CLKernelHandle<CLBuffer *, CLInt, CLBuffer *> * clearGridsKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLInt, CLInt2, CLBuffer *, CLBuffer *, CLBuffer *> * updateGridsKernel;
+CLKernelHandle<CLBuffer *, CLInt, CLBuffer *> * clearBinsKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLInt2, CLBuffer *, CLBuffer *, CLBuffer *> * countBinsKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt> * scanBinsKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLInt2, CLBuffer *, CLBuffer *, CLBuffer *> * scatterBinsKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLInt2, CLBuffer *, CLBuffer *> * gatherGridsKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLBuffer *, CLInt2, CLBuffer *, CLInt, CLBuffer *, CLFloat2, CLFloat, CLBuffer *, CLFloat> * updateTraceKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLInt2, CLFloat, CLFloat, CLBuffer *, CLFloat2, CLInt, CLFloat, CLInt> * updatePlayerKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLInt, CLInt2, CLFloat, CLFloat, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *> * updateParticlesKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLInt2, CLFloat, CLFloat, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *> * updateParticlesTiledKernel;
+CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLInt, CLBuffer *, CLInt2, CLFloat, CLFloat, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *> * updateParticlesSortedKernel;
+CLKernelHandle<CLImage *, CLInt2, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLInt2, CLInt> * shadeWorldKernel;
+CLKernelHandle<CLImageGL *, CLInt2, CLImage *, CLInt2, CLFloat3, CLFloat, CLFloat, CLFloat> * renderMainKernel;
+CLKernelHandle<CLImage *, CLInt2, CLImage *, CLInt2, CLFloat3, CLFloat, CLFloat, CLFloat> * renderFrameKernel; // render_main into scaledImage, or frameReadback without GL_INTEROP
+CLKernelHandle<CLImage *, CLInt2, CLImageGL *, CLInt2> * upscaleFrameKernel;
 GLFWwindow * window;
 GLFWmonitor * monitor;
 const GLFWvidmode * mode;
 double deltaTime = 1. / 60.;
 double gTime = 0.;
-int newParticleIndex = 0;
 bool anyParticlesAdded = false;
-int prtIndex0 = 0;
 
 GLuint WINDOW_WIDTH = 1024;
 GLuint WINDOW_HEIGHT = 1024;
 GLuint DATA_SIZE = WINDOW_WIDTH * WINDOW_HEIGHT * 4;
 bool WINDOW_RESIZED = false;
+#define OUTPUT_BUCKET 256
+// Frames without a resize event before a resize counts as finished; until then outImage isn't regrown
+#define RESIZE_SETTLE_FRAMES 10
+int resizeSettle = 0;
 bool FULLSCREEN = false;
 GLuint REFRESH_RATE = 60.;
 
 map<GLuint, bool> keyDown, lastKeyDown;
 
 Player player;
+// The host's player is the newest state read back from the device, a frame or two old (see
+// CLReadbackRing); input goes to update_player as arguments instead of being written back
+#define PLAYER_RING 3
+CLReadbackRing<Player, PLAYER_RING> playerRing;
+CLReadbackRing<CLInt2, PLAYER_RING> pageInfoRing;
 
 class FireLoc {
 public:
@@ -165,159 +353,995 @@ void setFullscreen (bool flag) {
     }
 }
 
+GLuint outputCapacity (GLuint size) {
+    return ((size + OUTPUT_BUCKET - 1) / OUTPUT_BUCKET) * OUTPUT_BUCKET;
+}
+
 void handleWindowResize () {
     if (WINDOW_RESIZED) {
-        delete outImage;
-        outImage = new CLImageGL(program, WINDOW_WIDTH, WINDOW_HEIGHT, MEMORY_WRITE);
         glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
+        resizeSettle = RESIZE_SETTLE_FRAMES;
         WINDOW_RESIZED = false;
     }
+    else if (resizeSettle > 0 && --resizeSettle == 0 && (WINDOW_WIDTH > outImage->width || WINDOW_HEIGHT > outImage->height)) {
+        // Nothing here waits on the device. With GL_INTEROP the last frame drawn from the old image has
+        // finished (see frameDone); without it the old image is only written by frameUpload, and the frame
+        // still being read back goes on in the old readback, which collectFrame presents into the new
+        // texture and then frees.
+        GLuint width = std::max(outputCapacity(WINDOW_WIDTH), outImage->width);
+        GLuint height = std::max(outputCapacity(WINDOW_HEIGHT), outImage->height);
+        delete outImage;
+        outImage = new CLImageGL(program, width, height, MEMORY_WRITE);
+        if (!GL_INTEROP) {
+            retiredReadback = frameReadback;
+            frameReadback = new CLFrameReadback(program, width, height);
+        }
+    }
+}
+
+// The part of outImage this frame fills: the window, or while a resize has outgrown the image, the largest
+// size of the window's shape that fits, which GL stretches until the image is regrown
+CLInt2 outputSize () {
+    if (HEADLESS || outImage == NULL || (WINDOW_WIDTH <= outImage->width && WINDOW_HEIGHT <= outImage->height)) {
+        return CLInt2(WINDOW_WIDTH, WINDOW_HEIGHT);
+    }
+    CLFloat fit = std::min((CLFloat)outImage->width / (CLFloat)WINDOW_WIDTH, (CLFloat)outImage->height / (CLFloat)WINDOW_HEIGHT);
+    return CLInt2(std::min(std::max((int)((CLFloat)WINDOW_WIDTH * fit), 1), (int)outImage->width),
+                  std::min(std::max((int)((CLFloat)WINDOW_HEIGHT * fit), 1), (int)outImage->height));
+}
+
+CLInt liveBound () {
+    // activeParity is the newest readback, so the other slot is taken first
+    for (int k=0; k<2; k++) {
+        int p = k == 0 ? 1 - activeParity : activeParity;
+        if (livePending[p] && liveEvent[p].getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE) {
+            livePending[p] = false;
+            liveKnown = liveReadback[p];
+            liveKnownSpawnedAt = liveSpawnedAt[p];
+        }
+    }
+    return (CLInt)std::min((long long)particleCapacity, (long long)liveKnown + (particlesSpawned - liveKnownSpawnedAt));
+}
+
+CLDefines kernelDefines (CLInt2 gridSize, bool sorted) {
+    CLDefines defines;
+    defines["TYPE_BITS"] = defineValue(gridTypeBits(sorted));
+    defines["GRID_PACKED"] = defineValue(sorted ? 1 : 0);
+    defines["GRID_MAXID"] = defineValue(GRID_MAXID);
+    defines["GRID_PLANES"] = defineValue(gridPlanes(sorted));
+    if (SPECIALIZE_KERNELS) {
+        defines["GRID_W"] = defineValue(gridSize.x);
+        defines["GRID_H"] = defineValue(gridSize.y);
+        defines["GRAVITY"] = defineValue(GRAVITY);
+        defines["NUM_TRACE"] = defineValue(NUM_TRACE);
+    }
+    return defines;
+}
+
+// The size render_main shades at; headless renders at exactly the size asked for
+CLInt2 scaledRenderSize () {
+    CLInt2 size = outputSize();
+    if (HEADLESS || RENDER_SCALE >= 1.f) {
+        return size;
+    }
+    return CLInt2(std::max((int)((CLFloat)size.x * RENDER_SCALE + 0.5f), 1),
+                  std::max((int)((CLFloat)size.y * RENDER_SCALE + 0.5f), 1));
+}
+
+bool renderScaled (CLInt2 renderSize) {
+    CLInt2 size = outputSize();
+    return renderSize.x != size.x || renderSize.y != size.y;
+}
+
+CLKernelBase * renderKernel () {
+    return !GL_INTEROP || renderScaled(currentRenderSize) ? (CLKernelBase *)renderFrameKernel : (CLKernelBase *)renderMainKernel;
+}
+
+// The render size changes while running (window resize, render scale), so it is always a kernel
+// argument rather than a specialised constant
+void setRenderSize (CLInt2 renderSize) {
+    if (renderSize.x != currentRenderSize.x || renderSize.y != currentRenderSize.y) {
+        // the background of empty cells depends on the render height
+        worldShadeFull = true;
+    }
+    currentRenderSize = renderSize;
+}
+
+// Resolves every kernel once; call after program and graph exist, before any launch
+void initKernels () {
+    clearRockLayerKernel = new CLKernelHandle<CLBuffer *, CLInt, CLBuffer *>(program, "clear_rock_layer");
+    freeSlotsKernel = new CLKernelHandle<CLBuffer *, CLInt, CLInt>(program, "free_slots");
+    buildRockMaskKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLInt2, CLBuffer *>(program, "build_rock_mask");
+    compactParticlesKernel = new CLKernelHandle<CLBuffer *, CLInt, CLBuffer *, CLInt, CLBuffer *>(program, "compact_particles");
+    spawnParticlesKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *>(program, "spawn_particles");
+    emitParticlesKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLInt, CLBuffer *, CLBuffer *, CLFloat2, CLInt>(program, "emit_particles");
+    markPagesKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLInt2, CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLBuffer *>(program, "mark_pages");
+    allocPagesKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *>(program, "alloc_pages");
+    checkPageReleaseKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLInt>(program, "check_page_release");
+    releasePageKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLInt>(program, "release_page");
+    finishPageReleaseKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *>(program, "finish_page_release");
+    resetPagesKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *>(program, "reset_pages");
+    clearGridsKernel = new CLKernelHandle<CLBuffer *, CLInt, CLBuffer *>(program, "clear_grids");
+    updateGridsKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLInt, CLInt2, CLBuffer *, CLBuffer *, CLBuffer *>(program, "update_grids");
+    clearBinsKernel = new CLKernelHandle<CLBuffer *, CLInt, CLBuffer *>(program, "clear_bins");
+    countBinsKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLInt2, CLBuffer *, CLBuffer *, CLBuffer *>(program, "count_bins");
+    scanBinsKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt>(program, "scan_bins");
+    scatterBinsKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLInt2, CLBuffer *, CLBuffer *, CLBuffer *>(program, "scatter_bins");
+    gatherGridsKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLInt2, CLBuffer *, CLBuffer *>(program, "gather_grids");
+    updateTraceKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLBuffer *, CLInt2, CLBuffer *, CLInt, CLBuffer *, CLFloat2, CLFloat, CLBuffer *, CLFloat>(program, "update_trace");
+    updatePlayerKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLInt2, CLFloat, CLFloat, CLBuffer *, CLFloat2, CLInt, CLFloat, CLInt>(program, "update_player");
+    updateParticlesKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLInt, CLInt2, CLFloat, CLFloat, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *>(program, "update_particles");
+    updateParticlesTiledKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLInt2, CLFloat, CLFloat, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *>(program, "update_particles_tiled");
+    updateParticlesSortedKernel = new CLKernelHandle<CLBuffer *, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLInt, CLBuffer *, CLInt2, CLFloat, CLFloat, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *>(program, "update_particles_sorted");
+    shadeWorldKernel = new CLKernelHandle<CLImage *, CLInt2, CLBuffer *, CLBuffer *, CLInt, CLBuffer *, CLBuffer *, CLBuffer *, CLBuffer *, CLInt2, CLInt>(program, "shade_world");
+    renderFrameKernel = new CLKernelHandle<CLImage *, CLInt2, CLImage *, CLInt2, CLFloat3, CLFloat, CLFloat, CLFloat>(program, "render_main");
+    renderMainKernel = new CLKernelHandle<CLImageGL *, CLInt2, CLImage *, CLInt2, CLFloat3, CLFloat, CLFloat, CLFloat>(program, "render_main");
+    upscaleFrameKernel = new CLKernelHandle<CLImage *, CLInt2, CLImageGL *, CLInt2>(program, "upscale_frame");
+    setRenderSize(scaledRenderSize());
+
+    CLKernelBase * handles[] = { clearRockLayerKernel, freeSlotsKernel, spawnParticlesKernel, emitParticlesKernel, markPagesKernel,
+                                 allocPagesKernel, checkPageReleaseKernel, releasePageKernel, resetPagesKernel, clearGridsKernel, updateGridsKernel, clearBinsKernel,
+                                 countBinsKernel, scatterBinsKernel, gatherGridsKernel, updateParticlesKernel, updateParticlesSortedKernel, buildRockMaskKernel,
+                                 shadeWorldKernel, renderFrameKernel, renderMainKernel, upscaleFrameKernel };
+    for (int i=0; i<(int)(sizeof(handles) / sizeof(handles[0])); i++) {
+        tuning->apply(handles[i]);
+    }
+}
+
+// Grows every per-particle buffer to capacity, keeping slots (and so particle ids) where they are
+void growParticles (CLInt capacity) {
+    CLInt old = particleCapacity;
+
+    CLBuffer * prt = new CLBuffer(program, capacity, sizeof(Particle), MEMORY_READ_WRITE);
+    Particle * data = (Particle *)prt->data;
+    for (CLInt i=0; i<capacity; i++) {
+        data[i].id = -1;
+    }
+    prt->writeSync();
+    CLBuffer * baked = new CLBuffer(program, capacity, sizeof(CLInt), MEMORY_READ_WRITE);
+    baked->writeSync();
+    CLBuffer * active = new CLBuffer(program, capacity + 2, sizeof(CLInt), MEMORY_READ_WRITE);
+    active->writeSync();
+    CLBuffer * freeList = new CLBuffer(program, capacity + 1, sizeof(CLInt), MEMORY_READ_WRITE);
+    freeList->writeSync();
+
+    if (old > 0) {
+        prt->copySync(particleBfr, old * sizeof(Particle));
+        baked->copySync(bakedBfr, old * sizeof(CLInt));
+        active->copySync(activeBfr, (old + 2) * sizeof(CLInt));
+        freeList->copySync(freeBfr, (old + 1) * sizeof(CLInt));
+        delete particleBfr;
+        delete bakedBfr;
+        delete activeBfr;
+        delete freeBfr;
+        delete binRankBfr;
+        delete sortedBfr;
+    }
+    particleBfr = prt;
+    bakedBfr = baked;
+    activeBfr = active;
+    freeBfr = freeList;
+    binRankBfr = new CLBuffer(program, capacity, sizeof(CLInt), MEMORY_READ_WRITE);
+    sortedBfr = new CLBuffer(program, capacity, sizeof(Particle), MEMORY_READ_WRITE);
+    particleCapacity = capacity;
+
+    if (old > 0) {
+        freeSlotsKernel->bind(freeBfr, old, capacity - old);
+        if (!graph->kernel(freeSlotsKernel, capacity - old, CLResources(), { freeBfr })) {
+            exit(0);
+        }
+    }
+}
+
+// Makes room for count more particles on top of the live bound; false once NUM_PARTICLES is reached
+bool reserveParticles (long long count) {
+    if (count <= particleCapacity) {
+        return true;
+    }
+    if (particleCapacity >= NUM_PARTICLES) {
+        return false;
+    }
+    growParticles((CLInt)std::min((long long)NUM_PARTICLES, std::max((long long)particleCapacity * 2, count)));
+    return count <= particleCapacity;
+}
+
+// Every slot starts out free, lowest slot on top
+void initFreeList () {
+    CLInt * data = (CLInt *)freeBfr->data;
+    data[0] = particleCapacity;
+    for (CLInt i=0; i<data[0]; i++) {
+        data[1 + i] = particleCapacity - 1 - i;
+    }
+    freeBfr->writeSync();
 }
 
 void clearParticles () {
-    prtIndex0 = 0;
-    Particle * data = new Particle[NUM_PARTICLES];
-    for (size_t i=0; i<NUM_PARTICLES; i++) {
+    Particle * data = (Particle *)particleBfr->data;
+    for (CLInt i=0; i<particleCapacity; i++) {
         data[i].id = -1;
     }
-    particleBfr->writeSync(0, NUM_PARTICLES * sizeof(Particle), (void *)data);
-    newParticleIndex = prtIndex0;
+    particleBfr->writeSync();
+    spawns.clear();
+    memset(bakedBfr->data, 0, particleCapacity * sizeof(CLInt));
+    bakedBfr->writeSync();
+    initFreeList();
+    livePending[0] = livePending[1] = false;
+    liveKnown = 0;
+    liveKnownSpawnedAt = particlesSpawned;
 }
 
-void addParticle (Particle & P) {
-    anyParticlesAdded = true;
-    P.id = newParticleIndex;
-    particleBfr->writeSync(newParticleIndex * sizeof(Particle), sizeof(Particle), (void *)&P);
-    newParticleIndex += 1;
-    if (newParticleIndex >= NUM_PARTICLES) {
-        newParticleIndex = prtIndex0;
+int footReach (int cls) {
+    return (int)ceil((float)cls * RADIUS_STEP + 1.);
+}
+
+// Distance to the nearest point of [i + 0.5 - f1, i + 0.5 - f0]
+float minCellOffset (int i, float f0, float f1) {
+    float a = (float)i + 0.5 - f1, b = (float)i + 0.5 - f0;
+    if (a <= 0. && b >= 0.) {
+        return 0.;
     }
+    return std::min(fabs(a), fabs(b));
 }
 
-void addParticles (Particle * data, int count) {
-    for (size_t i=0; i<count; i++) {
-        data[i].id = (newParticleIndex + i);
-        if (data[i].id >= NUM_PARTICLES) {
-            data[i].id = prtIndex0 + data[i].id - NUM_PARTICLES;
+// Footprint span table covering radii up to maxRadius
+vector<CLInt> footprintTable (CLFloat maxRadius) {
+    int classes = (int)ceil(maxRadius / RADIUS_STEP) + 1;
+    vector<CLInt> table(1 + classes, 0);
+    for (int c=0; c<classes; c++) {
+        int reach = footReach(c);
+        if (table.size() + FOOT_VARIANTS * (reach * 2 + 1) > FOOTPRINT_MAX_INTS) {
+            // larger radii fall back to scanning whole rows in the kernels
+            classes = c;
+            break;
+        }
+        table[1 + c] = table.size();
+        float R2 = (float)(c * RADIUS_STEP * c * RADIUS_STEP);
+        for (int v=0; v<FOOT_VARIANTS; v++) {
+            float sx = (float)(v % FOOT_SUBCELLS) / FOOT_SUBCELLS, sy = (float)(v / FOOT_SUBCELLS) / FOOT_SUBCELLS;
+            for (int j=-reach; j<=reach; j++) {
+                int i0 = reach + 1, i1 = -reach - 1;
+                for (int i=-reach; i<=reach; i++) {
+                    float dx = (float)i, dy = (float)j;
+                    if (v < FOOT_VARIANTS - 1) {
+                        dx = minCellOffset(i, sx, sx + 1. / FOOT_SUBCELLS);
+                        dy = minCellOffset(j, sy, sy + 1. / FOOT_SUBCELLS);
+                    }
+                    if ((dx*dx + dy*dy) <= R2) {
+                        i0 = std::min(i0, i);
+                        i1 = std::max(i1, i);
+                    }
+                }
+                table.push_back(((i0 + 128) << 8) | (i1 + 128));
+            }
         }
     }
-    if ((newParticleIndex + count) < NUM_PARTICLES) {
-        particleBfr->writeSync(newParticleIndex * sizeof(Particle), count * sizeof(Particle), (void *)data);
+    table[0] = classes;
+    return table;
+}
+
+// Rebuilds the footprint span table when a radius past the current one shows up. Oil grows by half
+// when it ignites on the device, so the table always covers 1.5x the largest radius spawned.
+void ensureFootprintRadius (CLFloat radius) {
+    if (radius * 1.5 <= footprintRadius) {
+        return;
     }
-    else {
-        int over = (newParticleIndex + count) - NUM_PARTICLES;
-        particleBfr->writeSync(newParticleIndex * sizeof(Particle), (count - over) * sizeof(Particle), (void *)data);
-        particleBfr->writeSync(prtIndex0 * sizeof(Particle), over * sizeof(Particle), (void *)(data + (count - over)));
-    }
-    newParticleIndex = newParticleIndex + count;
-    if (newParticleIndex >= NUM_PARTICLES) {
-        newParticleIndex = prtIndex0 + (newParticleIndex - NUM_PARTICLES);
-    }
-}
-
-void updateFireball (CLFloat2 pos, CLFloat r) {
-    int count = 4;
-    Particle * data = new Particle[count];
-    for (int i=0; i<count; i++) {
-        data[i].velocity.x = RAND * r * 4. - r * 2.;
-        data[i].velocity.y = RAND * r * 4. - r * 2.;
-        data[i].position.x = pos.x + data[i].velocity.x / 10.;
-        data[i].position.y = pos.y + data[i].velocity.y / 10.;
-        data[i].types.x = 0.;
-        data[i].types.y = 0.;
-        data[i].types.z = 1.;
-        data[i].types.w = 0.;
-        data[i].velocity.x = 0.;
-        data[i].velocity.y = 0.;
-        data[i].mass = 5.;
-        data[i].radius = r / 8.;
-        data[i].heat = 0.75;
-    }
-    addParticles(data, count);
-    delete data;
-}
-
-void updatePlayerGfx () {
+    footprintRadius = ceil(radius * 1.5);
+
+    vector<CLInt> table = footprintTable(footprintRadius);
+    if (footprintBfr != NULL) {
+        delete footprintBfr;
+    }
+    footprintBfr = new CLBuffer(program, table.size(), sizeof(CLInt), MEMORY_READ);
+    memcpy(footprintBfr->data, &table[0], table.size() * sizeof(CLInt));
+    footprintBfr->writeSync();
+}
+
+void footprintWeights (CLFloat * w) {
+    for (int k=0; k<=WEIGHT_LUT; k++) {
+        float d = sqrt((float)k / (float)WEIGHT_LUT);
+        w[k] = sqrt(1. - d);
+        w[WEIGHT_LUT + 1 + k] = 1. - d;
+    }
+}
+
+void initFootprintWeights () {
+    weightBfr = new CLBuffer(program, (WEIGHT_LUT + 1) * 2, sizeof(CLFloat), MEMORY_READ);
+    footprintWeights(weightBfr->dataFloat());
+    weightBfr->writeSync();
+}
+
+void addParticle (Particle & P) {
+    ensureFootprintRadius(P.radius);
+    anyParticlesAdded = true;
+    spawns.push_back(P);
+}
+
+// Uploads the level's spawns; spawn_particles gives them slots from the free list
+bool flushSpawns () {
+    CLInt count = (CLInt)spawns.size();
+    if (count == 0) {
+        return true;
+    }
+    reserveParticles((long long)liveBound() + count);
+    delete spawnBfr;
+    spawnBfr = new CLBuffer(program, count, sizeof(Particle), MEMORY_READ);
+    memcpy(spawnBfr->data, &spawns[0], count * sizeof(Particle));
+    spawnBfr->writeSync();
+    spawns.clear();
+    particlesSpawned += count;
+
+    spawnParticlesKernel->bind(particleBfr, spawnBfr, count, freeBfr);
+
+    return graph->kernel(spawnParticlesKernel, count, { spawnBfr }, { particleBfr, freeBfr });
+}
+
+void updateCamera () {
     CAMERA.x = player.position.x;
     CAMERA.y = player.position.y;
     CAMERA.z = 1.;
+}
+
+void addEmitter (Emitter & E) {
+    ensureFootprintRadius(E.radius);
+    E.first = emitTotal;
+    emitTotal += E.count;
+    emitters.push_back(E);
+}
+
+void uploadEmitters () {
+    if (emitterBfr != NULL) {
+        delete emitterBfr;
+    }
+    emitterBfr = new CLBuffer(program, emitters.size(), sizeof(Emitter), MEMORY_READ);
+    memcpy(emitterBfr->data, &emitters[0], emitters.size() * sizeof(Emitter));
+    emitterBfr->writeSync();
+    emitSeed = rand();
+}
+
+void initEmitters (CLFloat2 exitPos) {
+    emitters.clear();
+    emitTotal = 0;
+
+    for (size_t i=0; i<fireLocations.size(); i++) {
+        CLFloat r = 24.;
+        Emitter E;
+        E.position = fireLocations[i].pos;
+        E.spread = r * 0.2;
+        E.radius = r / 8.;
+        E.mass = 5.;
+        E.heat = 0.75;
+        E.types.z = 1.;
+        E.count = 4;
+        addEmitter(E);
+    }
+
+    Emitter gfx;
+    gfx.follow = EMIT_PLAYER;
+    gfx.spread = player.radius * 0.2;
+    gfx.radius = player.radius;
+    gfx.mass = 10.;
+    gfx.types.y = 2.;
+    gfx.count = 4;
+    addEmitter(gfx);
+
+    // two bursts of oil out of the exit per frame
+    Emitter outlet;
+    outlet.position = exitPos;
+    outlet.velocity.x = -5.; outlet.velocity.y = 0.;
+    outlet.velocityRange.x = 10.; outlet.velocityRange.y = 25.;
+    outlet.scaleRange = 1.;
+    outlet.radius = player.radius;
+    outlet.mass = 10.;
+    outlet.types.y = 3.;
+    outlet.count = 16;
+    outlet.burst = 8;
+    addEmitter(outlet);
+
+    Emitter spray = outlet;
+    spray.follow = EMIT_AIM;
+    spray.velocity.x = spray.velocity.y = 0.;
+    spray.velocityRange.x = spray.velocityRange.y = 0.;
+    spray.count = 8;
+    addEmitter(spray);
+
+    uploadEmitters();
+}
+
+bool emitParticles (bool spray, CLFloat2 target) {
+    CLInt count = emitTotal - (spray ? 0 : emitters.back().count);
+    reserveParticles((long long)liveBound() + count);
+
+    emitParticlesKernel->bind(particleBfr, emitterBfr, (CLInt)emitters.size(), count, freeBfr, playerBfr, target,
+                              emitSeed++);
+
+    if (!graph->kernel(emitParticlesKernel, count, { emitterBfr, playerBfr }, { particleBfr, freeBfr })) {
+        return false;
+    }
+
+    particlesSpawned += count;
+    return true;
+}
+
+int numPages () {
+    return ((GRID_SIZE.x + PAGE_SIZE - 1) / PAGE_SIZE) * ((GRID_SIZE.y + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+// Rock occupancy bitmask, one bit per cell and one word per page row
+CLInt maskWords () {
+    return (GRID_SIZE.x + 31) / 32;
+}
+
+CLInt gridStride () {
+    return gridPageCapacity * PAGE_CELLS;
+}
+
+CLBuffer * newGridPool (CLInt capacity, CLBuffer * old, int planes, int maxIDPlane) {
+    size_t stride = capacity * PAGE_CELLS;
+    CLBuffer * grid = new CLBuffer(program, stride * planes, sizeof(CLInt), MEMORY_READ_WRITE);
+    CLInt * maxID = (CLInt *)grid->data + stride * maxIDPlane;
+    for (size_t i=0; i<stride; i++) {
+        maxID[i] = -1;
+    }
+    grid->writeSync();
+    if (old != NULL) {
+        size_t oldStride = gridStride() * sizeof(CLInt);
+        for (int p=0; p<planes; p++) {
+            grid->copySync(old, p * oldStride, p * stride * sizeof(CLInt), oldStride);
+        }
+        delete old;
+    }
+    return grid;
+}
+
+// Creates the page pools, or grows them keeping the first `used` pages
+void allocGridPages (CLInt capacity, CLInt used) {
+    CLBuffer * list = new CLBuffer(program, capacity, sizeof(CLInt), MEMORY_READ_WRITE);
+    list->writeSync();
+    if (gridBfr != NULL) {
+        list->copySync(pageListBfr, pageListBfr->dataSize);
+        delete pageListBfr;
+    }
+    gridBfr = newGridPool(capacity, gridBfr, gridPlanes(SORTED_GRID_BUILD), GRID_MAXID);
+    staleGridBfr = newGridPool(capacity, staleGridBfr, gridPlanes(SORTED_GRID_BUILD), GRID_MAXID);
+    rockLayerBfr = newGridPool(capacity, rockLayerBfr, ROCK_PLANES, ROCK_MAXID);
+
+    CLInt info[4] = { used, capacity, -1, 0 };
+    pageInfoBfr->writeSync(0, sizeof(info), (void *)info);
+
+    pageListBfr = list;
+    gridPageCapacity = capacity;
+}
+
+// The pool written by update_grids alternates every frame, see update_particles
+void swapGrids () {
+    CLBuffer * tmp = gridBfr;
+    gridBfr = staleGridBfr;
+    staleGridBfr = tmp;
+}
+
+// Grows the pool if alloc_pages ran out of slots, going by the newest page_info that has been read
+// back. Pages it could not map are marked again on later frames.
+void checkGridPages () {
+    CLInt2 info;
+    pageInfoRing.request(graph, pageInfoBfr, 0);
+    if (pageInfoRing.latest(info) && info.x > gridPageCapacity) {
+        allocGridPages(std::min(std::max(gridPageCapacity * 2, info.x), (CLInt)numPages()), gridPageCapacity);
+        // reads still in flight predate the resize
+        pageInfoRing.clear();
+    }
+}
+
+void reserveGridPages (CLInt count) {
+    if (count > gridPageCapacity) {
+        CLInt info[2];
+        pageInfoBfr->readSync(0, sizeof(info), (void *)info);
+        allocGridPages(std::min(count, (CLInt)numPages()), std::min(info[0], gridPageCapacity));
+    }
+}
+
+// Releases the page alloc_pages nominated, if any, see alloc_pages. Runs before the grid build so
+// the last slot can be moved while the grid being built is still clear.
+bool releaseGridPage () {
+    checkPageReleaseKernel->bind(pageTableBfr, pageInfoBfr, rockLayerBfr, gridStride());
+
+    releasePageKernel->bind(pageTableBfr, pageInfoBfr, rockLayerBfr, gridBfr, staleGridBfr, gridStride());
 
-    int count = 4;
-    Particle * data = new Particle[count];
-    CLFloat r = player.radius;
-    for (int i=0; i<count; i++) {
-        data[i].velocity.x = RAND * r * 2. - r;
-        data[i].velocity.y = RAND * r * 2. - r;
-        data[i].position.x = player.position.x + data[i].velocity.x / 5.;
-        data[i].position.y = player.position.y + data[i].velocity.y / 5.;
-        data[i].types.x = 0.;
-        data[i].types.y = 2.;
-        data[i].types.z = 0.;
-        data[i].types.w = 0.;
-        data[i].velocity.x = 0.;
-        data[i].velocity.y = 0.;
-        data[i].mass = 10.;
-        data[i].radius = r;
-        data[i].heat = 0.;
-    }
-    addParticles(data, count);
-    delete data;
-}
-
-void oilSpray (CLFloat2 pos, CLFloat velx, CLFloat vely) {
-    int count = 8;
-    Particle * data = new Particle[count];
-    for (int i=0; i<count; i++) {
-        float r = (RAND * 2. + 2.) * 0.5;
-        data[i].velocity.x = velx * r;
-        data[i].velocity.y = vely * r;
-        data[i].position.x = pos.x;
-        data[i].position.y = pos.y;
-        data[i].types.x = 0.;
-        data[i].types.y = 3.;
-        data[i].types.z = 0.;
-        data[i].types.w = 0.;
-        data[i].mass = 10.;
-        data[i].radius = player.radius;
-        data[i].heat = 0.;
-    }
-    addParticles(data, count);
-    delete data;
+    finishPageReleaseKernel->bind(pageTableBfr, pageListBfr, pageInfoBfr, pageIdleBfr);
+
+    return graph->kernel(checkPageReleaseKernel, PAGE_CELLS, { pageTableBfr, rockLayerBfr }, { pageInfoBfr }) &&
+           graph->kernel(releasePageKernel, PAGE_CELLS, { pageTableBfr, pageInfoBfr }, { rockLayerBfr, gridBfr, staleGridBfr }) &&
+           graph->kernel(finishPageReleaseKernel, 1, CLResources(), { pageTableBfr, pageListBfr, pageInfoBfr, pageIdleBfr });
+}
+
+void resetGridPages () {
+    resetPagesKernel->bind(pageFlagsBfr, pageTableBfr, pageInfoBfr, (CLInt)numPages(), pageTouchedBfr, pageIdleBfr);
+
+    clearRockLayerKernel->bind(rockLayerBfr, gridStride(), pageInfoBfr);
+
+    if (!graph->kernel(clearRockLayerKernel, gridPageCapacity * PAGE_CELLS, { pageInfoBfr }, { rockLayerBfr })) {
+        exit(0);
+    }
+
+    for (int i=0; i<2; i++) {
+        clearGridsKernel->bind(i ? staleGridBfr : gridBfr, gridStride(), pageInfoBfr);
+        if (!graph->kernel(clearGridsKernel, gridPageCapacity * PAGE_CELLS, { pageInfoBfr }, { i ? staleGridBfr : gridBfr })) {
+            exit(0);
+        }
+    }
+
+    if (!graph->kernel(resetPagesKernel, numPages(), CLResources(), { pageFlagsBfr, pageTableBfr, pageInfoBfr, pageTouchedBfr, pageIdleBfr })) {
+        exit(0);
+    }
+    worldShadeFull = true;
+}
+
+int numBins () {
+    return ((GRID_SIZE.x + BIN_SIZE - 1) / BIN_SIZE) * ((GRID_SIZE.y + BIN_SIZE - 1) / BIN_SIZE);
+}
+
+bool compactParticles () {
+    liveLaunch = std::max(liveBound(), 1);
+    activeParity = 1 - activeParity;
+
+    compactParticlesKernel->bind(particleBfr, particleCapacity, activeBfr, activeParity, freeBfr);
+
+    if (!graph->kernel(compactParticlesKernel, particleCapacity, COMPACT_GROUP, { particleBfr }, { activeBfr, freeBfr })) {
+        return false;
+    }
+
+    graph->read(activeBfr, activeParity * sizeof(CLInt), sizeof(CLInt), (void *)&liveReadback[activeParity], &liveEvent[activeParity]);
+    liveSpawnedAt[activeParity] = particlesSpawned;
+    livePending[activeParity] = true;
+    return true;
+}
+
+bool updateGrids () {
+    if (!compactParticles()) {
+        return false;
+    }
+
+    markPagesKernel->bind(particleBfr, activeBfr, activeParity, GRID_SIZE, pageFlagsBfr, bakedBfr, rockLayerBfr,
+                          gridStride(), pageTableBfr, footprintBfr, weightBfr);
+
+    allocPagesKernel->bind(pageFlagsBfr, pageTableBfr, pageListBfr, pageInfoBfr, (CLInt)numPages(), pageTouchedBfr, pageIdleBfr);
+
+    if (!graph->kernel(markPagesKernel, liveLaunch, { particleBfr, activeBfr, pageTableBfr, footprintBfr, weightBfr }, { pageFlagsBfr, bakedBfr, rockLayerBfr }) ||
+        !graph->kernel(allocPagesKernel, numPages(), CLResources(), { pageFlagsBfr, pageTableBfr, pageListBfr, pageInfoBfr, pageTouchedBfr, pageIdleBfr }) ||
+        !releaseGridPage()) {
+        return false;
+    }
+
+    if (!SORTED_GRID_BUILD) {
+        updateGridsKernel->bind(particleBfr, gridBfr, gridStride(), pageTableBfr, activeBfr, activeParity, GRID_SIZE,
+                                footprintBfr, weightBfr, bakedBfr);
+
+        return graph->kernel(updateGridsKernel, liveLaunch, { particleBfr, pageTableBfr, activeBfr, footprintBfr, weightBfr, bakedBfr }, { gridBfr });
+    }
+
+    CLInt bins = numBins();
+
+    clearBinsKernel->bind(binCountBfr, bins, sortInfoBfr);
+
+    countBinsKernel->bind(particleBfr, activeBfr, activeParity, GRID_SIZE, binCountBfr, binRankBfr, sortInfoBfr);
+
+    scanBinsKernel->bind(binCountBfr, binStartBfr, bins);
+
+    scatterBinsKernel->bind(particleBfr, activeBfr, activeParity, GRID_SIZE, binStartBfr, binRankBfr, sortedBfr);
+
+    gatherGridsKernel->bind(sortedBfr, binStartBfr, sortInfoBfr, gridBfr, gridStride(), pageListBfr, pageInfoBfr,
+                            GRID_SIZE, weightBfr, bakedBfr);
+
+    return graph->kernel(clearBinsKernel, bins, CLResources(), { binCountBfr, sortInfoBfr }) &&
+           graph->kernel(countBinsKernel, liveLaunch, { particleBfr, activeBfr }, { binCountBfr, binRankBfr, sortInfoBfr }) &&
+           graph->kernel(scanBinsKernel, 256, 256, { binCountBfr }, { binStartBfr }) &&
+           graph->kernel(scatterBinsKernel, liveLaunch, { particleBfr, activeBfr, binStartBfr, binRankBfr }, { sortedBfr }) &&
+           graph->kernel(gatherGridsKernel, gridPageCapacity * PAGE_CELLS, { sortedBfr, binStartBfr, sortInfoBfr, pageListBfr, pageInfoBfr, weightBfr, bakedBfr }, { gridBfr });
+}
+
+// After the grid build, for update_player and update_trace
+bool buildRockMask () {
+    buildRockMaskKernel->bind(gridBfr, rockLayerBfr, gridStride(), pageTableBfr, GRID_SIZE, rockMaskBfr);
+    return graph->kernel(buildRockMaskKernel, maskWords() * GRID_SIZE.y, { gridBfr, rockLayerBfr, pageTableBfr }, { rockMaskBfr });
+}
+
+// Reshades the pages touched this frame or the last into worldImage, or every cell after a reset
+bool shadeWorld () {
+    shadeWorldKernel->bind(worldImage, currentRenderSize, gridBfr, rockLayerBfr, gridStride(), pageTableBfr, pageListBfr, pageInfoBfr,
+                           pageTouchedBfr, GRID_SIZE, (CLInt)worldShadeFull);
+    size_t n = worldShadeFull ? (size_t)GRID_SIZE.x * GRID_SIZE.y : (size_t)gridPageCapacity * PAGE_CELLS;
+    worldShadeFull = false;
+    return graph->kernel(shadeWorldKernel, n, { gridBfr, rockLayerBfr, pageTableBfr, pageListBfr, pageInfoBfr, pageTouchedBfr }, { worldImage });
+}
+
+// render_main into the window's GL texture (acquired by the caller), or without GL_INTEROP into the
+// readback image of this frame
+bool renderFrame (CLInt2 renderSize, CLFloat3 camera, CLFloat deathT, CLFloat winT) {
+    // the same view in fewer pixels when rendering below the window's size
+    camera.z *= (CLFloat)WINDOW_WIDTH / (CLFloat)renderSize.x;
+    if (!GL_INTEROP) {
+        // a scaled frame is read back at its render size and GL stretches it, which moves fewer pixels
+        // than upscaling it on the device first
+        renderFrameKernel->bind(frameReadback->target(), renderSize, worldImage, GRID_SIZE, camera, player.health, deathT, winT);
+        return graph->kernel2D(renderFrameKernel, renderSize.x, renderSize.y, { worldImage }, { frameReadback->target() });
+    }
+    if (renderScaled(renderSize)) {
+        CLInt2 outSize = outputSize();
+        if (scaledImage == NULL || scaledImage->width != (size_t)renderSize.x || scaledImage->height != (size_t)renderSize.y) {
+            delete scaledImage;
+            scaledImage = new CLImage(program, renderSize.x, renderSize.y);
+        }
+        renderFrameKernel->bind(scaledImage, renderSize, worldImage, GRID_SIZE, camera, player.health, deathT, winT);
+        upscaleFrameKernel->bind(scaledImage, renderSize, outImage, outSize);
+        return graph->kernel2D(renderFrameKernel, renderSize.x, renderSize.y, { worldImage }, { scaledImage }) &&
+               graph->kernel2D(upscaleFrameKernel, outSize.x, outSize.y, { scaledImage }, { outImage });
+    }
+    renderMainKernel->bind(outImage, renderSize, worldImage, GRID_SIZE, camera, player.health, deathT, winT);
+    return graph->kernel2D(renderMainKernel, renderSize.x, renderSize.y, { worldImage }, { outImage });
+}
+
+void presentFrame (CLFrameReadback * readback) {
+    int slot = readback->next;
+    if (readback->pending[slot]) {
+        size_t width = readback->width[slot], height = readback->height[slot];
+        unsigned char * pixels = frameUpload->begin(width, height);
+        readback->collect(graph, pixels, width * 4);
+        frameUpload->end(outImage->glTex, width, height);
+        presentSize = CLInt2(width, height);
+    }
+}
+
+// Called after request(): takes the previous frame, whose map has had this frame's host work to complete,
+// to the writer (headless) or into outImage's texture, and frees its image for the next frame
+void collectFrame () {
+    static vector<unsigned char> rgba;
+    if (HEADLESS) {
+        if (frameWriter == NULL) {
+            frameReadback->collect(graph, NULL, 0);
+        }
+        else if (frameReadback->collect(graph, rgba)) {
+            frameWriter->push(rgba);
+        }
+    }
+    else {
+        if (retiredReadback != NULL) {
+            // its last request was the previous frame
+            retiredReadback->next ^= 1;
+            presentFrame(retiredReadback);
+            delete retiredReadback;
+            retiredReadback = NULL;
+        }
+        presentFrame(frameReadback);
+    }
+}
+
+bool updateParticles (CLFloat dt) {
+    if (TILED_PARTICLES) {
+        updateParticlesTiledKernel->bind(particleBfr, sortedBfr, binStartBfr, gridBfr, gridStride(), pageTableBfr,
+                                         GRID_SIZE, dt, GRAVITY, footprintBfr, weightBfr, rockLayerBfr, bakedBfr,
+                                         freeBfr);
+
+        return graph->kernel(updateParticlesTiledKernel, numBins() * TILE_GROUP, TILE_GROUP,
+                             { sortedBfr, binStartBfr, gridBfr, pageTableBfr, footprintBfr, weightBfr, rockLayerBfr },
+                             { particleBfr, bakedBfr, freeBfr });
+    }
+
+    if (SORTED_GRID_BUILD) {
+        updateParticlesSortedKernel->bind(particleBfr, sortedBfr, binStartBfr, numBins(), gridBfr, gridStride(), pageTableBfr,
+                                          GRID_SIZE, dt, GRAVITY, footprintBfr, weightBfr, rockLayerBfr, bakedBfr, freeBfr);
+
+        return graph->kernel(updateParticlesSortedKernel, liveLaunch,
+                             { sortedBfr, binStartBfr, gridBfr, pageTableBfr, footprintBfr, weightBfr, rockLayerBfr },
+                             { particleBfr, bakedBfr, freeBfr });
+    }
+
+    updateParticlesKernel->bind(particleBfr, gridBfr, gridStride(), pageTableBfr, activeBfr, activeParity, GRID_SIZE,
+                                dt, GRAVITY, staleGridBfr, pageInfoBfr, footprintBfr,
+                                weightBfr, rockLayerBfr, bakedBfr, freeBfr);
+
+    return graph->kernel(updateParticlesKernel, std::max(liveLaunch, CLEAR_MIN_ITEMS),
+                         { gridBfr, pageTableBfr, activeBfr, pageInfoBfr, footprintBfr, weightBfr, rockLayerBfr },
+                         { particleBfr, staleGridBfr, bakedBfr, freeBfr });
 }
 
 void fastForward(int frames, CLFloat dt) {
     CLFloat2 wmp;
     wmp.x = 256.; wmp.y = 256.;
     for (int k=0; k<frames; k++) {
-        program->setArg("update_grids", 0, particleBfr);
-        program->setArg("update_grids", 1, gridBfr);
-        program->setArg("update_grids", 2, NUM_PARTICLES);
-        program->setArg("update_grids", 3, GRID_SIZE);
-
-        program->setArg("clear_grids", 0, gridBfr);
-        program->setArg("clear_grids", 1, GRID_SIZE);
-
-        program->setArg("update_particles", 0, particleBfr);
-        program->setArg("update_particles", 1, gridBfr);
-        program->setArg("update_particles", 2, NUM_PARTICLES);
-        program->setArg("update_particles", 3, GRID_SIZE);
-        program->setArg("update_particles", 4, (CLFloat)dt);
-        program->setArg("update_particles", 5, GRAVITY);
-
-        if (!program->callFunction("clear_grids", GRID_SIZE.x * GRID_SIZE.y)) {
+        swapGrids();
+
+        if (!updateGrids()) {
             exit(0);
         }
 
-        if (!program->callFunction("update_grids", NUM_PARTICLES)) {
+        if (!updateParticles(dt)) {
             exit(0);
         }
 
-        if (!program->callFunction("update_particles", NUM_PARTICLES)) {
-            exit(0);
+        checkGridPages();
+        graph->wait();
+    }
+}
+
+// One simulated frame of the current level for the autotuner, with everything the game loop launches
+// at the handles' own work group shapes (the tiled, compact and scan kernels have fixed ones)
+void autotuneFrame () {
+    clearGridsKernel->bind(staleGridBfr, gridStride(), pageInfoBfr);
+    if (!graph->kernel(clearGridsKernel, gridPageCapacity * PAGE_CELLS, { pageInfoBfr }, { staleGridBfr })) {
+        exit(0);
+    }
+
+    swapGrids();
+
+    if (!updateGrids() || !buildRockMask() || !updateParticles(1./60.)) {
+        exit(0);
+    }
+
+    CLFloat3 camera;
+    camera.x = player.position.x;
+    camera.y = player.position.y;
+    camera.z = 1.;
+    if (GL_INTEROP) {
+        graph->acquireGL(outImage);
+    }
+    if (!shadeWorld() || !renderFrame(currentRenderSize, camera, 0., 0.)) {
+        exit(0);
+    }
+    if (GL_INTEROP) {
+        graph->releaseGL(outImage);
+    }
+    else {
+        frameReadback->request(graph, currentRenderSize.x, currentRenderSize.y);
+        frameReadback->drain(graph);
+    }
+
+    checkGridPages();
+    graph->wait();
+}
+
+// Tries the candidate shapes of all tunable kernels in lockstep, round r giving every kernel its r-th
+// candidate, and keeps each kernel's fastest by profiled time. Kernels that didn't run (other grid
+// build path) keep their old shape.
+void autotuneKernels () {
+    vector<CLKernelBase *> kernels = { shadeWorldKernel, buildRockMaskKernel, markPagesKernel, allocPagesKernel, checkPageReleaseKernel, releasePageKernel, clearGridsKernel, updateGridsKernel,
+                                       clearBinsKernel, countBinsKernel, scatterBinsKernel, gatherGridsKernel, updateParticlesKernel, updateParticlesSortedKernel, renderKernel(),
+                                       upscaleFrameKernel };
+    vector<vector<std::pair<size_t, size_t> > > candidates;
+    vector<std::pair<size_t, size_t> > best(kernels.size());
+    vector<double> bestTime(kernels.size(), -1.);
+    size_t rounds = 0;
+    for (size_t k=0; k<kernels.size(); k++) {
+        candidates.push_back(kernels[k]->candidates(kernels[k] == renderKernel() || kernels[k] == upscaleFrameKernel));
+        rounds = std::max(rounds, candidates[k].size());
+        best[k] = std::make_pair(kernels[k]->localShape[0], kernels[k]->localShape[1]);
+    }
+
+    for (size_t r=0; r<rounds; r++) {
+        for (size_t k=0; k<kernels.size(); k++) {
+            if (r < candidates[k].size()) {
+                kernels[k]->localShape[0] = candidates[k][r].first;
+                kernels[k]->localShape[1] = candidates[k][r].second;
+                kernels[k]->localSize = candidates[k][r].first * candidates[k][r].second;
+            }
+        }
+        autotuneFrame(); // warm up
+        program->kernelTime.clear();
+        for (int f=0; f<AUTOTUNE_FRAMES; f++) {
+            autotuneFrame();
+        }
+        for (size_t k=0; k<kernels.size(); k++) {
+            double time = program->kernelTime[kernels[k]->name];
+            if (r < candidates[k].size() && time > 0. && (bestTime[k] < 0. || time < bestTime[k])) {
+                bestTime[k] = time;
+                best[k] = candidates[k][r];
+            }
+        }
+    }
+    program->kernelTime.clear();
+
+    for (size_t k=0; k<kernels.size(); k++) {
+        kernels[k]->localShape[0] = best[k].first;
+        kernels[k]->localShape[1] = best[k].second;
+        kernels[k]->localSize = best[k].first * best[k].second;
+        if (bestTime[k] >= 0.) {
+            tuning->store(kernels[k]->name, best[k].first, best[k].second);
+            cerr << "autotune: " << kernels[k]->name << " " << best[k].first << "x" << best[k].second << " "
+                 << (bestTime[k] / (double)AUTOTUNE_FRAMES) << "ms" << endl;
         }
     }
+    tuning->save();
 }
 
+// Device benchmark for CLContext: one frame of the passes that scale with the particle count
+// (emit_particles, compact_particles, update_grids, update_particles) from kernels/main.cl, built with
+// the game's defines for a BENCH_GRID square grid with every page resident. The atomic grid layout is
+// used whatever the options, the particle passes are shared with the sorted build. The grid pools
+// ping-pong as in play; particles, free list and live counters are uploaded again before each frame.
+#define BENCH_GRID 256
+#define BENCH_PARTICLES 65536
+#define BENCH_EMIT 1024
+
+class FrameBenchmark : public CLBenchmark {
+public:
+    string code;
+    string options;
+    cl::Program prog;
+    cl::Kernel emitKernel, compactKernel, gridsKernel, updateKernel;
+    cl::Buffer particleBuf, activeBuf, freeBuf, emitterBuf, playerBuf, pageTableBuf, pageInfoBuf,
+               footprintBuf, weightBuf, rockLayerBuf, bakedBuf, gridBuf[2];
+    vector<Particle> particles;
+    vector<CLInt> freeList;
+    CLInt counters[2];
+    int frames;
+
+    FrameBenchmark () {
+        ifstream file("kernels/main.cl");
+        stringstream buffer;
+        buffer << file.rdbuf();
+        code = buffer.str();
+        options = defineOptions(kernelDefines(CLInt2(BENCH_GRID, BENCH_GRID), false));
+
+        // one particle per cell, emitter slots free on top of the stack
+        CLInt live = BENCH_PARTICLES - BENCH_EMIT;
+        particles.resize(BENCH_PARTICLES);
+        for (CLInt i=0; i<live; i++) {
+            Particle & P = particles[i];
+            P.id = i;
+            P.position.x = (CLFloat)(i % BENCH_GRID) + 0.5f;
+            P.position.y = (CLFloat)((i / BENCH_GRID + (i % BENCH_GRID) * 7) % BENCH_GRID) + 0.5f;
+            P.radius = 2.;
+            P.mass = 10.;
+            P.heat = 0.;
+            P.types.x = P.types.y = P.types.z = P.types.w = 0.;
+            if (i % 8 == 0) {
+                P.heat = 0.75;
+                P.types.z = 1.;
+            }
+            else if (i % 2) {
+                P.types.y = 1.;
+            }
+            else {
+                P.types.w = 1.;
+            }
+        }
+        freeList.assign(1 + BENCH_PARTICLES, 0);
+        freeList[0] = BENCH_EMIT;
+        for (CLInt i=0; i<BENCH_EMIT; i++) {
+            freeList[1 + i] = BENCH_PARTICLES - 1 - i;
+        }
+        counters[0] = counters[1] = 0;
+        frames = 0;
+    }
+
+    string name () {
+        stringstream ss;
+        ss << "main.cl " << options << " " << std::hex << hashBytes(code.c_str(), code.length());
+        return ss.str();
+    }
+
+    bool kernel (cl::Kernel & k, const char * kernelName) {
+        CLInt err;
+        k = cl::Kernel(prog, kernelName, &err);
+        return err == CL_SUCCESS;
+    }
+
+    bool buffer (cl::Buffer & b, cl::Context & context, size_t size, const void * data) {
+        CLInt err;
+        b = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, (void *)data, &err);
+        return err == CL_SUCCESS;
+    }
+
+    bool setup (cl::Context & context, cl::Device & device, cl::CommandQueue & queue) {
+        vector<cl::Device> one(1, device);
+        prog = cl::Program(context, cl::Program::Sources(1, std::make_pair(code.c_str(), code.length())));
+        if (code.empty() || prog.build(one, options.c_str()) != CL_SUCCESS ||
+            !kernel(emitKernel, "emit_particles") || !kernel(compactKernel, "compact_particles") ||
+            !kernel(gridsKernel, "update_grids") || !kernel(updateKernel, "update_particles")) {
+            return false;
+        }
+
+        Emitter E;
+        E.position.x = E.position.y = (CLFloat)BENCH_GRID * 0.5f;
+        E.velocity.x = -5.; E.velocity.y = 0.;
+        E.velocityRange.x = 10.; E.velocityRange.y = 25.;
+        E.radius = 3.;
+        E.mass = 10.;
+        E.types.y = 3.;
+        E.count = BENCH_EMIT;
+        E.burst = 8;
+        Player player(E.position.x, E.position.y);
+
+        CLInt pages = (BENCH_GRID / PAGE_SIZE) * (BENCH_GRID / PAGE_SIZE), stride = pages * PAGE_CELLS;
+        vector<CLInt> pageTable(pages);
+        for (CLInt i=0; i<pages; i++) {
+            pageTable[i] = i;
+        }
+        CLInt pageInfo[4] = { pages, pages, -1, 0 };
+        vector<CLInt> footprint = footprintTable(ceil(E.radius * 1.5));
+        vector<CLFloat> weights((WEIGHT_LUT + 1) * 2);
+        footprintWeights(&weights[0]);
+        vector<CLInt> grid(stride * gridPlanes(false), 0), rockLayer(stride * ROCK_PLANES, 0), zeros(2 + BENCH_PARTICLES, 0);
+        std::fill(grid.begin() + stride * GRID_MAXID, grid.begin() + stride * (GRID_MAXID + 1), -1);
+        std::fill(rockLayer.begin() + stride * ROCK_MAXID, rockLayer.begin() + stride * (ROCK_MAXID + 1), -1);
+
+        if (!buffer(particleBuf, context, particles.size() * sizeof(Particle), &particles[0]) ||
+            !buffer(activeBuf, context, zeros.size() * sizeof(CLInt), &zeros[0]) ||
+            !buffer(freeBuf, context, freeList.size() * sizeof(CLInt), &freeList[0]) ||
+            !buffer(emitterBuf, context, sizeof(Emitter), &E) ||
+            !buffer(playerBuf, context, sizeof(Player), &player) ||
+            !buffer(pageTableBuf, context, pages * sizeof(CLInt), &pageTable[0]) ||
+            !buffer(pageInfoBuf, context, sizeof(pageInfo), pageInfo) ||
+            !buffer(footprintBuf, context, footprint.size() * sizeof(CLInt), &footprint[0]) ||
+            !buffer(weightBuf, context, weights.size() * sizeof(CLFloat), &weights[0]) ||
+            !buffer(rockLayerBuf, context, rockLayer.size() * sizeof(CLInt), &rockLayer[0]) ||
+            !buffer(bakedBuf, context, BENCH_PARTICLES * sizeof(CLInt), &zeros[0]) ||
+            !buffer(gridBuf[0], context, grid.size() * sizeof(CLInt), &grid[0]) ||
+            !buffer(gridBuf[1], context, grid.size() * sizeof(CLInt), &grid[0])) {
+            return false;
+        }
+
+        CLInt2 gridSize(BENCH_GRID, BENCH_GRID);
+        emitKernel.setArg(0, particleBuf);
+        emitKernel.setArg(1, emitterBuf);
+        emitKernel.setArg(2, (CLInt)1);
+        emitKernel.setArg(3, (CLInt)BENCH_EMIT);
+        emitKernel.setArg(4, freeBuf);
+        emitKernel.setArg(5, playerBuf);
+        emitKernel.setArg(6, E.position);
+        compactKernel.setArg(0, particleBuf);
+        compactKernel.setArg(1, (CLInt)BENCH_PARTICLES);
+        compactKernel.setArg(2, activeBuf);
+        compactKernel.setArg(4, freeBuf);
+        gridsKernel.setArg(0, particleBuf);
+        gridsKernel.setArg(2, stride);
+        gridsKernel.setArg(3, pageTableBuf);
+        gridsKernel.setArg(4, activeBuf);
+        gridsKernel.setArg(6, gridSize);
+        gridsKernel.setArg(7, footprintBuf);
+        gridsKernel.setArg(8, weightBuf);
+        gridsKernel.setArg(9, bakedBuf);
+        updateKernel.setArg(0, particleBuf);
+        updateKernel.setArg(2, stride);
+        updateKernel.setArg(3, pageTableBuf);
+        updateKernel.setArg(4, activeBuf);
+        updateKernel.setArg(6, gridSize);
+        updateKernel.setArg(7, (CLFloat)(1. / 60.));
+        updateKernel.setArg(8, GRAVITY);
+        updateKernel.setArg(10, pageInfoBuf);
+        updateKernel.setArg(11, footprintBuf);
+        updateKernel.setArg(12, weightBuf);
+        updateKernel.setArg(13, rockLayerBuf);
+        updateKernel.setArg(14, bakedBuf);
+        updateKernel.setArg(15, freeBuf);
+        frames = 0;
+        return true;
+    }
+
+    CLInt reset (cl::CommandQueue & queue) {
+        CLInt err = queue.enqueueWriteBuffer(particleBuf, CL_FALSE, 0, particles.size() * sizeof(Particle), &particles[0]);
+        err |= queue.enqueueWriteBuffer(freeBuf, CL_FALSE, 0, freeList.size() * sizeof(CLInt), &freeList[0]);
+        err |= queue.enqueueWriteBuffer(activeBuf, CL_FALSE, 0, sizeof(counters), counters);
+        return err;
+    }
+
+    CLInt frame (cl::CommandQueue & queue) {
+        CLInt parity = frames & 1;
+        emitKernel.setArg(7, (CLInt)frames);
+        compactKernel.setArg(3, parity);
+        gridsKernel.setArg(1, gridBuf[parity]);
+        gridsKernel.setArg(5, parity);
+        updateKernel.setArg(1, gridBuf[parity]);
+        updateKernel.setArg(5, parity);
+        updateKernel.setArg(9, gridBuf[1 - parity]);
+        frames++;
+
+        CLInt err = queue.enqueueNDRangeKernel(emitKernel, cl::NullRange, cl::NDRange(BENCH_EMIT), cl::NullRange);
+        err |= queue.enqueueNDRangeKernel(compactKernel, cl::NullRange, cl::NDRange(BENCH_PARTICLES), cl::NDRange(COMPACT_GROUP));
+        err |= queue.enqueueNDRangeKernel(gridsKernel, cl::NullRange, cl::NDRange(BENCH_PARTICLES), cl::NullRange);
+        err |= queue.enqueueNDRangeKernel(updateKernel, cl::NullRange, cl::NDRange(BENCH_PARTICLES), cl::NullRange);
+        return err;
+    }
+};
+
 bool genMaze(int x, int y, int & tx, int & ty, int msize, int pathLen, bool * U) {
     if (pathLen >= (msize * msize / 4 - 10)) {
         tx = x;
@@ -370,6 +1394,7 @@ CLFloat2 endPos;
 void initLevel() {
     fireLocations.clear();
     clearParticles();
+    resetGridPages();
 
     hasWon = false;
 
@@ -407,6 +1432,8 @@ void initLevel() {
     }
 
     player.reset((((float)mstartx) + 0.5) * (float)msz / (float)size * (float)GRID_SIZE.x, (((float)mstarty) + 0.9) * (float)msz / (float)size * (float)GRID_SIZE.y);
+    playerRing.clear();
+    playerBfr->writeSync(0, sizeof(Player), (void *)&player);
     endPos.x = (((float)mendx) + 0.5) * (float)msz / (float)size * (float)GRID_SIZE.x;
     endPos.y = (((float)mendy) + 0.9) * (float)msz / (float)size * (float)GRID_SIZE.y;
 
@@ -438,17 +1465,10 @@ void initLevel() {
         grid = grid2;
         grid2 = tmp;
     }
-    int count = 0;
-    for (int x=0; x<size; x++) {
-        for (int y=0; y<size; y++) {
-            int G = grid[x + y*size];
-            if (G == 1) {
-                count += 1;
-            }
-        }
+    bool * rockPages = new bool[numPages()];
+    for (int i=0; i<numPages(); i++) {
+        rockPages[i] = false;
     }
-    Particle * newPrt = new Particle[count];
-    int idx = 0;
     for (int x=0; x<size; x++) {
         for (int y=0; y<size; y++) {
             bool rock = grid[x + y*size] == 1;
@@ -464,20 +1484,36 @@ void initLevel() {
                 P.types.y = 0.;
                 P.types.z = 0.;
                 P.types.w = 0.;
-                newPrt[idx] = P;
-                idx ++;
+                addParticle(P);
+                int r = (int)ceil(P.radius + 1.);
+                for (int px=std::max((int)P.position.x - r, 0) / PAGE_SIZE; px<=std::min((int)P.position.x + r, GRID_SIZE.x - 1) / PAGE_SIZE; px++) {
+                    for (int py=std::max((int)P.position.y - r, 0) / PAGE_SIZE; py<=std::min((int)P.position.y + r, GRID_SIZE.y - 1) / PAGE_SIZE; py++) {
+                        rockPages[px + py * ((GRID_SIZE.x + PAGE_SIZE - 1) / PAGE_SIZE)] = true;
+                    }
+                }
             }
         }
     }
-    addParticles(newPrt, count);
-    delete newPrt;
+    if (!flushSpawns()) {
+        exit(0);
+    }
+
+    CLInt pagesUsed = 0;
+    for (int i=0; i<numPages(); i++) {
+        pagesUsed += rockPages[i] ? 1 : 0;
+    }
+    delete rockPages;
+    reserveGridPages(pagesUsed + pagesUsed / 4 + 16);
+
     delete grid;
     delete grid2;
     gTime = 0.;
 
-    prtIndex0 = newParticleIndex;
+    initEmitters(endPos);
 
     fastForward(60 * 1, 1./60.);
+
+    program->kernelTime.clear();
 }
 
 #define CAMX(_X, _C) (((float)(_X) - (float)_C.x) / _C.z + ((float)WINDOW_WIDTH) * 0.5)
@@ -496,13 +1532,13 @@ void boundCamera(CLFloat3 & cameraIn, CLFloat3 & cameraOut) {
 
     if (gsx <= (float)WINDOW_WIDTH) {
         float lcz = cameraOut.z;
-        cameraOut.z = min(cameraOut.z, gsx / ((float)WINDOW_WIDTH));
+        cameraOut.z = std::min(cameraOut.z, gsx / ((float)WINDOW_WIDTH));
         cameraOut.x = 0.5 * (float)GRID_SIZE.x;
     }
 
     if (gsy <= (float)WINDOW_HEIGHT) {
         float lcz = cameraOut.z;
-        cameraOut.z = min(cameraOut.z, gsy / ((float)WINDOW_HEIGHT));
+        cameraOut.z = std::min(cameraOut.z, gsy / ((float)WINDOW_HEIGHT));
         cameraOut.y = 0.5 * (float)GRID_SIZE.y;
     }
 
@@ -532,49 +1568,132 @@ void boundCamera(CLFloat3 & cameraIn, CLFloat3 & cameraOut) {
 
 }
 
-int main (void)
+int main (int argc, char ** argv)
 {
     srand(time(0));
 
-    if (!glfwInit()) {
-        return -1;
-    }
-
-    window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Caves of Titan", NULL, NULL);
-    if (!window) {
-        glfwTerminate();
-        return -1;
+    for (int i=1; i<argc; i++) {
+        string arg = argv[i];
+        if (arg == "-sortgrid") {
+            SORTED_GRID_BUILD = true;
+        }
+        else if (arg == "-tiled") {
+            SORTED_GRID_BUILD = true;
+            TILED_PARTICLES = true;
+        }
+        else if (arg == "-typebits" && (i + 1) < argc) {
+            TYPE_BITS = atoi(argv[++i]) == 8 ? 8 : 16;
+        }
+        else if (arg == "-profile") {
+            PROFILE_KERNELS = true;
+        }
+        else if (arg == "-particles" && (i + 1) < argc) {
+            NUM_PARTICLES = atoi(argv[++i]);
+        }
+        else if (arg == "-nospecialize") {
+            SPECIALIZE_KERNELS = false;
+        }
+        else if (arg == "-autotune") {
+            AUTOTUNE = true;
+        }
+        else if (arg == "-renderscale" && (i + 1) < argc) {
+            RENDER_SCALE = std::min(std::max((CLFloat)atof(argv[++i]) / 100.f, RENDER_SCALE_MIN), 1.f);
+        }
+        else if (arg == "-cpu") {
+            USE_CPU = true;
+        }
+        else if (arg == "-headless" && (i + 2) < argc) {
+            HEADLESS = true;
+            WINDOW_WIDTH = (GLuint)atoi(argv[++i]);
+            WINDOW_HEIGHT = (GLuint)atoi(argv[++i]);
+        }
+        else if (arg == "-frames" && (i + 1) < argc) {
+            HEADLESS_FRAMES = atoi(argv[++i]);
+        }
+        else if (arg == "-fps" && (i + 1) < argc) {
+            HEADLESS_FPS = std::max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "-dump" && (i + 1) < argc) {
+            DUMP_TARGET = argv[++i];
+        }
     }
 
-    soundEngine = createIrrKlangDevice();
-    if (!soundEngine) {
-        return -1;
-    }
+    if (!HEADLESS) {
+        if (!glfwInit()) {
+            return -1;
+        }
 
-    glfwMakeContextCurrent(window);
+        window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "Caves of Titan", NULL, NULL);
+        if (!window) {
+            glfwTerminate();
+            return -1;
+        }
 
-    glfwSetWindowSizeCallback(window, onWindowResize);
-    glfwSetKeyCallback(window, onKeyboard);
+        soundEngine = createIrrKlangDevice();
+        if (!soundEngine) {
+            return -1;
+        }
 
-    clContext = new CLContext();
+        glfwMakeContextCurrent(window);
 
-    program = new CLProgram(clContext, "main");
+        glfwSetWindowSizeCallback(window, onWindowResize);
+        glfwSetKeyCallback(window, onKeyboard);
+    }
 
-    outImage = new CLImageGL(program, WINDOW_WIDTH, WINDOW_HEIGHT, MEMORY_WRITE);
+    FrameBenchmark * bench = new FrameBenchmark();
+    clContext = new CLContext(!HEADLESS, USE_CPU ? DEVICE_CPU : DEVICE_ANY, bench);
+    delete bench;
+    GL_INTEROP = clContext->glShared;
+
+    programs = new CLProgramCache(clContext, "main", PROFILE_KERNELS || AUTOTUNE);
+    tuning = new CLTuning(clContext, TUNING_FILE);
+    program = programs->get(kernelDefines(GRID_SIZE, SORTED_GRID_BUILD));
+    graph = new CLFrameGraph(program);
+    initKernels();
+
+    if (HEADLESS) {
+        frameReadback = new CLFrameReadback(program, WINDOW_WIDTH, WINDOW_HEIGHT);
+        if (DUMP_TARGET.length() > 0) {
+            frameWriter = new FrameWriter(DUMP_TARGET, WINDOW_WIDTH, WINDOW_HEIGHT, DUMP_QUEUE);
+        }
+    }
+    else {
+        outImage = new CLImageGL(program, outputCapacity(WINDOW_WIDTH), outputCapacity(WINDOW_HEIGHT), MEMORY_WRITE);
+        if (!GL_INTEROP) {
+            frameReadback = new CLFrameReadback(program, outImage->width, outImage->height);
+            frameUpload = new GLPixelUpload();
+        }
+    }
 
-    particleBfr = new CLBuffer(program, NUM_PARTICLES, sizeof(Particle), MEMORY_READ_WRITE);
-    gridBfr     = new CLBuffer(program, GRID_SIZE.x * GRID_SIZE.y, sizeof(GridCell), MEMORY_READ_WRITE);
+    growParticles(std::min(NUM_PARTICLES, (CLInt)PARTICLE_MIN_CAPACITY));
+    pageTableBfr = new CLBuffer(program, numPages(), sizeof(CLInt), MEMORY_READ_WRITE);
+    pageFlagsBfr = new CLBuffer(program, numPages(), sizeof(CLInt), MEMORY_READ_WRITE);
+    pageInfoBfr  = new CLBuffer(program, 4, sizeof(CLInt), MEMORY_READ_WRITE);
+    pageTouchedBfr = new CLBuffer(program, numPages(), sizeof(CLInt), MEMORY_READ_WRITE);
+    pageIdleBfr = new CLBuffer(program, numPages(), sizeof(CLInt), MEMORY_READ_WRITE);
+    worldImage = new CLImage(program, GRID_SIZE.x, GRID_SIZE.y);
+    allocGridPages(numPages() / 4, 0);
     traceBfr    = new CLBuffer(program, NUM_TRACE, sizeof(Trace), MEMORY_READ_WRITE);
     playerBfr   = new CLBuffer(program, 1, sizeof(Player), MEMORY_READ_WRITE);
+    rockMaskBfr = new CLBuffer(program, maskWords() * GRID_SIZE.y, sizeof(CLUInt), MEMORY_READ_WRITE);
+    binCountBfr = new CLBuffer(program, numBins(), sizeof(CLInt), MEMORY_READ_WRITE);
+    binStartBfr = new CLBuffer(program, numBins() + 1, sizeof(CLInt), MEMORY_READ_WRITE);
+    sortInfoBfr = new CLBuffer(program, 1, sizeof(CLInt), MEMORY_READ_WRITE);
+    initFootprintWeights();
+    ensureFootprintRadius(player.radius);
 
     particleBfr->writeSync();
-    gridBfr->writeSync();
     traceBfr->writeSync();
 
-    monitor = glfwGetPrimaryMonitor();
-    mode = glfwGetVideoMode(monitor);
+    if (HEADLESS) {
+        deltaTime = 1. / (double)HEADLESS_FPS;
+    }
+    else {
+        monitor = glfwGetPrimaryMonitor();
+        mode = glfwGetVideoMode(monitor);
 
-    deltaTime = 1. / (double)(REFRESH_RATE);
+        deltaTime = 1. / (double)(REFRESH_RATE);
+    }
 
     initLevel();
 
@@ -582,12 +1701,24 @@ int main (void)
     //CAMERA.y = (float)GRID_SIZE.y * 0.5;
     CAMERA.z = 1.;
 
-    soundEngine->play2D("sfx/music.ogg", true);
+    if (AUTOTUNE) {
+        autotuneKernels();
+    }
 
-    while (!glfwWindowShouldClose(window)) {
+    if (soundEngine != NULL) {
+        soundEngine->play2D("sfx/music.ogg", true);
+    }
+
+    int profileFrames = 0;
+    int frame = 0;
+    std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now();
+
+    while (HEADLESS ? frame < HEADLESS_FRAMES : !glfwWindowShouldClose(window)) {
+
+        playerRing.latest(player);
 
         if (player.health <= 0. && !hasWon) {
-            if (deathTimer < 0.0001 && (deathTimer + deltaTime * 2.) >= 0.0001) {
+            if (deathTimer < 0.0001 && (deathTimer + deltaTime * 2.) >= 0.0001 && soundEngine != NULL) {
                 soundEngine->play2D("sfx/die.ogg", false);
             }
             deathTimer += deltaTime * 2.;
@@ -603,10 +1734,9 @@ int main (void)
         }
 
         if (hasWon) {
-            if (winTimer < 0.0001 && (winTimer + deltaTime * 2.) >= 0.0001) {
+            if (winTimer < 0.0001 && (winTimer + deltaTime * 2.) >= 0.0001 && soundEngine != NULL) {
                 soundEngine->play2D("sfx/win.ogg", false);
             }
-            player.health += (100. - player.health) * deltaTime;
             deathTimer -= deltaTime * 2.;
             if (deathTimer < 0.) {
                 deathTimer = 0.;
@@ -623,187 +1753,231 @@ int main (void)
             }
         }
 
-        if (lastKeyDown[GLFW_KEY_F11] && !keyDown[GLFW_KEY_F11]) {
-            setFullscreen(!FULLSCREEN);
-        }
-
-        handleWindowResize();
+        if (!HEADLESS) {
+            if (lastKeyDown[GLFW_KEY_F11] && !keyDown[GLFW_KEY_F11]) {
+                setFullscreen(!FULLSCREEN);
+            }
+            if (lastKeyDown[GLFW_KEY_MINUS] && !keyDown[GLFW_KEY_MINUS]) {
+                RENDER_SCALE = std::max(RENDER_SCALE - RENDER_SCALE_STEP, RENDER_SCALE_MIN);
+            }
+            if (lastKeyDown[GLFW_KEY_EQUAL] && !keyDown[GLFW_KEY_EQUAL]) {
+                RENDER_SCALE = std::min(RENDER_SCALE + RENDER_SCALE_STEP, 1.f);
+            }
 
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            handleWindowResize();
 
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        glOrtho(0.0, 1., 0.0, 1., -1.0, 1.0);
-        glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        for (size_t i=0; i<fireLocations.size(); i++) {
-            updateFireball(fireLocations[i].pos, 24.);
+            glMatrixMode(GL_PROJECTION);
+            glLoadIdentity();
+            glOrtho(0.0, 1., 0.0, 1., -1.0, 1.0);
+            glMatrixMode(GL_MODELVIEW);
+            glLoadIdentity();
         }
 
-        updatePlayerGfx();
+        updateCamera();
 
         CLFloat3 camera2;
         boundCamera(CAMERA, camera2);
 
-        double mouseX, mouseY;
-        glfwGetCursorPos(window, &mouseX, &mouseY);
+        // headless, the mouse rests in the middle of the view with no buttons down
+        double mouseX = 0.5 * (double)WINDOW_WIDTH, mouseY = 0.5 * (double)WINDOW_HEIGHT;
+        if (!HEADLESS) {
+            glfwGetCursorPos(window, &mouseX, &mouseY);
+        }
 
         CLFloat2 worldMouse;
         worldMouse.x = ICAMX(mouseX, camera2);
         worldMouse.y = ICAMY(mouseY, camera2);
 
-        CLInt2 renderSize(WINDOW_WIDTH, WINDOW_HEIGHT);
-
-        if (player.moving == 0 && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS && player.health > 0 && !hasWon) {
-            float velx = (worldMouse.x - player.position.x) * 2.;
-            float vely = (worldMouse.y - player.position.y) * 2.;
-            float speed = sqrt(velx*velx+vely*vely);
-            if (speed > 1.) {
-                if (speed > 400.) {
-                    velx /= speed;
-                    vely /= speed;
-                    speed = 400.;
-                    velx *= speed;
-                    vely *= speed;
-                }
-                player.moving = 1;
-                player.velocity.x = velx;
-                player.velocity.y = vely;
-            }
-        }
-        if (player.moving == 0) {
-            player.velocity.x = player.velocity.y = 0.;
-        }        
-        if ((glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS || hasWon) && player.health > 0) {
-            float velx = (worldMouse.x - player.position.x) * 2.;
-            float vely = (worldMouse.y - player.position.y) * 2.;
-            float speed = sqrt(velx*velx+vely*vely);
-            if (speed > 1.) {
-                if (speed > 400.) {
-                    velx /= speed;
-                    vely /= speed;
-                    speed = 400.;
-                    velx *= speed;
-                    vely *= speed;
-                }
-                oilSpray(player.position, velx + player.velocity.x, vely + player.velocity.y);
-            }
-        }
+        CLInt2 renderSize = scaledRenderSize();
+        setRenderSize(renderSize);
 
-        oilSpray(endPos, RAND * 10. - 5., 5. * RAND * 5.);
-        oilSpray(endPos, RAND * 10. - 5., 5. * RAND * 5.);
+        // both are aimed on the device from its current player position
+        bool launch = !HEADLESS && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS && player.health > 0 && !hasWon;
+        bool spray = ((!HEADLESS && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS) || hasWon) && player.health > 0;
 
         double dx = endPos.x - player.position.x, dy = endPos.y - player.position.y;
         if (sqrt(dx*dx+dy*dy) < ((float)GRID_SIZE.x / 48.f)) {
             hasWon = true;
         }
 
-        playerBfr->writeSync(0, sizeof(Player), (void *)&player);
-       
-        program->setArg("update_grids", 0, particleBfr);
-        program->setArg("update_grids", 1, gridBfr);
-        program->setArg("update_grids", 2, NUM_PARTICLES);
-        program->setArg("update_grids", 3, GRID_SIZE);
-
-        if (player.moving == 0 && !hasWon && player.health > 0) {
-            program->setArg("update_trace", 0, gridBfr);
-            program->setArg("update_trace", 1, GRID_SIZE);
-            program->setArg("update_trace", 2, traceBfr);
-            program->setArg("update_trace", 3, NUM_TRACE);
-            program->setArg("update_trace", 4, worldMouse);
-            program->setArg("update_trace", 5, (CLFloat)deltaTime);
-            program->setArg("update_trace", 6, player.position);
-            program->setArg("update_trace", 7, GRAVITY);
-        }
-
-        program->setArg("update_player", 0, gridBfr);
-        program->setArg("update_player", 1, GRID_SIZE);
-        program->setArg("update_player", 2, (CLFloat)deltaTime);
-        program->setArg("update_player", 3, GRAVITY);
-        program->setArg("update_player", 4, playerBfr);
-
-        program->setArg("clear_grids", 0, gridBfr);
-        program->setArg("clear_grids", 1, GRID_SIZE);
-
-        program->setArg("update_particles", 0, particleBfr);
-        program->setArg("update_particles", 1, gridBfr);
-        program->setArg("update_particles", 2, NUM_PARTICLES);
-        program->setArg("update_particles", 3, GRID_SIZE);
-        program->setArg("update_particles", 4, (CLFloat)deltaTime);
-        program->setArg("update_particles", 5, GRAVITY);
-
-        program->setArg("render_main", 0, outImage);
-        program->setArg("render_main", 1, renderSize);
-        program->setArg("render_main", 2, gridBfr);
-        program->setArg("render_main", 3, GRID_SIZE);
-        program->setArg("render_main", 4, camera2);
-        program->setArg("render_main", 5, player.health);
-        program->setArg("render_main", 6, (CLFloat)deathTimer);
-        program->setArg("render_main", 7, (CLFloat)winTimer);
-
-        program->acquireImageGL(outImage);
-
-        if (!program->callFunction("clear_grids", GRID_SIZE.x * GRID_SIZE.y)) {
+        if (!emitParticles(spray, worldMouse)) {
             exit(0);
         }
+       
+        swapGrids();
+
+        updateTraceKernel->bind(gridBfr, rockMaskBfr, gridStride(), pageTableBfr, pageListBfr, pageInfoBfr,
+                                GRID_SIZE, traceBfr, NUM_TRACE, pageTouchedBfr, worldMouse, (CLFloat)deltaTime,
+                                playerBfr, GRAVITY);
+
+        updatePlayerKernel->bind(gridBfr, rockMaskBfr, gridStride(), pageTableBfr, GRID_SIZE, (CLFloat)deltaTime,
+                                 GRAVITY, playerBfr, worldMouse, (CLInt)launch, (CLFloat)(hasWon ? deltaTime : 0.),
+                                 (CLInt)(player.health > 0 && !hasWon));
+
+        if (GL_INTEROP) {
+            graph->acquireGL(outImage);
+        }
 
-        if (!program->callFunction("update_grids", NUM_PARTICLES)) {
+        if (!updateGrids() || !buildRockMask()) {
             exit(0);
         }
 
-        if (player.moving == 0 && player.health > 0 && !hasWon) {
-            if (!program->callFunction("update_trace", 1)) {
+        if (!hasWon) {
+            // update_trace maps the pages it draws into, adds to their GRID_TRACE and marks them touched;
+            // it checks the player's moving flag and health on the device
+            if (!graph->kernel(updateTraceKernel, 1, { rockMaskBfr, playerBfr }, { traceBfr, gridBfr, pageTableBfr, pageListBfr, pageInfoBfr, pageTouchedBfr })) {
                 exit(0);
             }
         }
 
-        if (player.health > 0 && !hasWon) {
-            if (!program->callFunction("update_player", 1)) {
-                exit(0);
-            }
+        if (!graph->kernel(updatePlayerKernel, 1, { gridBfr, rockMaskBfr, pageTableBfr }, { playerBfr })) {
+            exit(0);
         }
+        playerRing.request(graph, playerBfr, 0);
 
-        if (!program->callFunction("update_particles", NUM_PARTICLES)) {
+        if (!updateParticles((CLFloat)deltaTime)) {
             exit(0);
         }
 
-        if (!program->callFunction("render_main", WINDOW_WIDTH * WINDOW_HEIGHT)) {
+        if (!shadeWorld() || !renderFrame(renderSize, camera2, (CLFloat)deathTimer, (CLFloat)winTimer)) {
             exit(0);
         }
 
-        playerBfr->readSync(0, sizeof(Player), (void *)&player);
+        if (GL_INTEROP) {
+            cl::Event frameDone;
+            graph->releaseGL(outImage, &frameDone);
 
-        program->releaseImageGL(outImage);
+            checkGridPages();
 
-        glEnable(GL_TEXTURE_2D);
-        glBindTexture(GL_TEXTURE_2D, outImage->glTex);
+            // GL can draw once the image is released; the rest of the frame (update_particles on an
+            // out-of-order queue, the readbacks) may still be running
+            frameDone.wait();
+            graph->retire();
+        }
+        else {
+            // this frame's map completes while the next one simulates; the previous frame's is taken now
+            frameReadback->request(graph, renderSize.x, renderSize.y);
+            collectFrame();
+            checkGridPages();
+            graph->retire();
+        }
 
-        glBegin(GL_QUADS);
-            glTexCoord2f(0., 1.); glVertex2f(0., 0.);
-            glTexCoord2f(0., 0.); glVertex2f(0., 1.);
-            glTexCoord2f(1., 0.); glVertex2f(1., 1.);
-            glTexCoord2f(1., 1.); glVertex2f(1., 0.);
-        glEnd();
+        if (!HEADLESS) {
+            glEnable(GL_TEXTURE_2D);
+            glBindTexture(GL_TEXTURE_2D, outImage->glTex);
+
+            CLInt2 outSize = GL_INTEROP ? outputSize() : presentSize;
+            // texel centres of the written rectangle, so the linear filter never reaches past its edges when
+            // the frame is stretched
+            float u0 = 0.5f / (float)outImage->width, v0 = 0.5f / (float)outImage->height;
+            float u1 = ((float)outSize.x - 0.5f) / (float)outImage->width, v1 = ((float)outSize.y - 0.5f) / (float)outImage->height;
+            if (outSize.x > 0) {
+                glBegin(GL_QUADS);
+                    glTexCoord2f(u0, v1); glVertex2f(0., 0.);
+                    glTexCoord2f(u0, v0); glVertex2f(0., 1.);
+                    glTexCoord2f(u1, v0); glVertex2f(1., 1.);
+                    glTexCoord2f(u1, v1); glVertex2f(1., 0.);
+                glEnd();
+            }
 
-        glfwSwapBuffers(window);
+            glfwSwapBuffers(window);
 
-        lastKeyDown = keyDown;
+            lastKeyDown = keyDown;
 
-        glfwPollEvents();
+            glfwPollEvents();
+        }
 
         gTime += deltaTime;
+        frame++;
+
+        if (PROFILE_KERNELS && ++profileFrames >= 120) {
+            program->reportProfile(profileFrames);
+            profileFrames = 0;
+        }
     }
 
+    if (HEADLESS) {
+        // the last frame is still mapped
+        frameReadback->next ^= 1;
+        collectFrame();
+        graph->wait();
+        double runMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - runStart).count();
+        cerr << "headless: " << frame << " frames at " << WINDOW_WIDTH << "x" << WINDOW_HEIGHT << " in " << runMs << "ms ("
+             << (runMs / (double)std::max(frame, 1)) << "ms per frame)" << endl;
+        delete frameWriter;
+    }
+
+    delete clearRockLayerKernel;
+    delete freeSlotsKernel;
+    delete buildRockMaskKernel;
+    delete compactParticlesKernel;
+    delete spawnParticlesKernel;
+    delete emitParticlesKernel;
+    delete markPagesKernel;
+    delete allocPagesKernel;
+    delete checkPageReleaseKernel;
+    delete releasePageKernel;
+    delete finishPageReleaseKernel;
+    delete resetPagesKernel;
+    delete clearGridsKernel;
+    delete updateGridsKernel;
+    delete clearBinsKernel;
+    delete countBinsKernel;
+    delete scanBinsKernel;
+    delete scatterBinsKernel;
+    delete gatherGridsKernel;
+    delete updateTraceKernel;
+    delete updatePlayerKernel;
+    delete updateParticlesKernel;
+    delete updateParticlesTiledKernel;
+    delete updateParticlesSortedKernel;
+    delete shadeWorldKernel;
+    delete renderMainKernel;
+    delete renderFrameKernel;
+    delete upscaleFrameKernel;
+    delete scaledImage;
+    if (frameReadback != NULL && !HEADLESS) {
+        frameReadback->drain(graph);
+    }
+    delete frameReadback;
+    delete frameUpload;
+    delete graph;
+    delete sortInfoBfr;
+    delete sortedBfr;
+    delete activeBfr;
+    delete freeBfr;
+    delete binRankBfr;
+    delete binStartBfr;
+    delete binCountBfr;
+    delete pageInfoBfr;
+    delete pageTouchedBfr;
+    delete pageIdleBfr;
+    delete worldImage;
+    delete footprintBfr;
+    delete weightBfr;
+    delete emitterBfr;
+    delete spawnBfr;
+    delete pageListBfr;
+    delete pageTableBfr;
+    delete pageFlagsBfr;
     delete gridBfr;
+    delete staleGridBfr;
+    delete rockLayerBfr;
+    delete rockMaskBfr;
+    delete bakedBfr;
     delete particleBfr;
     delete traceBfr;
     delete playerBfr;
     delete outImage;
-    delete program;
+    delete programs;
+    delete tuning;
     delete clContext;
     delete soundEngine;
 
-    glfwTerminate();
+    if (!HEADLESS) {
+        glfwTerminate();
+    }
     return 0;
 }
\ No newline at end of file